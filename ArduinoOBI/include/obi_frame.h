@@ -0,0 +1,85 @@
+#ifndef OBI_FRAME_H
+#define OBI_FRAME_H
+
+/*
+ * Compile time frames. Constant command bytes are given as template
+ * arguments, the Dallas CRC8/CRC16 of a frame (same as OneWire::crc8 and
+ * OneWire::crc16) is computed by the compiler and the bytes are placed in
+ * flash. Written for C++11, so constexpr functions are single expressions.
+ *
+ *   typedef obi::Step<0x33, 0x09, 0xDA, 0x31> LedsOn;
+ *   typedef obi::Macro<TestMode, LedsOn> LedsOnMacro;
+ *   memcpy_P(buf, LedsOnMacro::data, LedsOnMacro::size);
+ */
+
+#include <Arduino.h>
+#include <stdint.h>
+
+namespace obi {
+
+constexpr uint8_t crc8_bits(uint8_t crc, uint8_t bits) {
+    return bits == 0 ? crc : crc8_bits((crc & 0x01) ? (crc >> 1) ^ 0x8C : crc >> 1, bits - 1);
+}
+
+constexpr uint8_t crc8(uint8_t crc) {
+    return crc;
+}
+
+template <typename... Rest>
+constexpr uint8_t crc8(uint8_t crc, uint8_t byte, Rest... rest) {
+    return crc8(crc8_bits(crc ^ byte, 8), rest...);
+}
+
+constexpr uint16_t crc16_bits(uint16_t crc, uint8_t bits) {
+    return bits == 0 ? crc : crc16_bits((crc & 0x0001) ? (crc >> 1) ^ 0xA001 : crc >> 1, bits - 1);
+}
+
+constexpr uint16_t crc16(uint16_t crc) {
+    return crc;
+}
+
+template <typename... Rest>
+constexpr uint16_t crc16(uint16_t crc, uint8_t byte, Rest... rest) {
+    return crc16(crc16_bits(crc ^ byte, 8), rest...);
+}
+
+/* A constant byte sequence in flash with its CRCs */
+template <uint8_t... Bytes>
+struct Frame {
+    static constexpr uint8_t size = sizeof...(Bytes);
+    static constexpr uint8_t crc8 = obi::crc8(0, Bytes...);
+    static constexpr uint16_t crc16 = obi::crc16(0, Bytes...);
+    static const uint8_t data[sizeof...(Bytes)] PROGMEM;
+};
+
+template <uint8_t... Bytes>
+const uint8_t Frame<Bytes...>::data[sizeof...(Bytes)] PROGMEM = { Bytes... };
+
+/* A macro step: data length, response length, command, data */
+template <uint8_t Cmd, uint8_t RspLen, uint8_t... Data>
+struct Step : Frame<sizeof...(Data), RspLen, Cmd, Data...> {
+    typedef Frame<sizeof...(Data), RspLen, Cmd, Data...> frame;
+};
+
+/* Concatenate frames, Join<A, B, C>::frame is the frame with the bytes of A, B and C */
+template <typename First, typename... Rest>
+struct Join {
+    typedef First frame;
+};
+
+template <uint8_t... A, uint8_t... B, typename... Rest>
+struct Join<Frame<A...>, Frame<B...>, Rest...> {
+    typedef typename Join<Frame<A..., B...>, Rest...>::frame frame;
+};
+
+/*
+ * A macro laid out like an EEPROM macro slot: steps length, then the steps.
+ * Its crc8 is the slot CRC the host compares against.
+ */
+template <typename... Steps>
+struct Macro : Join<Frame<Join<typename Steps::frame...>::frame::size>, typename Steps::frame...>::frame {
+};
+
+} // namespace obi
+
+#endif // OBI_FRAME_H
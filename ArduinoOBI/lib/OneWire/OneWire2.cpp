@@ -164,6 +164,9 @@ void OneWire::begin(uint8_t pin)
 	pinMode(pin, INPUT);
 	bitmask = PIN_TO_BITMASK(pin);
 	baseReg = PIN_TO_BASEREG(pin);
+	timingLog = NULL;
+	timingLeft = 0;
+	set_reset_timing(0, 0);
 #if ONEWIRE_SEARCH
 	reset_search();
 #endif
@@ -196,17 +199,77 @@ uint8_t CRIT_TIMING OneWire::reset(void)
 	DIRECT_WRITE_LOW(reg, mask);
 	DIRECT_MODE_OUTPUT(reg, mask);	// drive output low
 	interrupts();
-	// OBI modification, was 480
-	delayMicroseconds(750);
+	delayMicroseconds(resetLowUs);
 	noInterrupts();
 	DIRECT_MODE_INPUT(reg, mask);	// allow it to float
-	delayMicroseconds(70);
+	delayMicroseconds(ONEWIRE_PRESENCE_SAMPLE_US);
 	r = !DIRECT_READ(reg, mask);
 	interrupts();
-	delayMicroseconds(410);
+	delayMicroseconds(resetRecoveryUs);
 	return r;
 }
 
+//
+// Reset and time the presence pulse. The line is polled against micros(),
+// which has 4 us resolution on 16 MHz AVRs. The bus is idle for as long
+// after the release as with reset(), unless the pulse lasts longer.
+//
+uint8_t CRIT_TIMING OneWire::reset_timed(uint16_t *presence_start, uint16_t *presence_length)
+{
+	IO_REG_TYPE mask IO_REG_MASK_ATTR = bitmask;
+	__attribute__((unused)) volatile IO_REG_TYPE *reg IO_REG_BASE_ATTR = baseReg;
+	uint8_t retries = 125;
+	uint32_t start, low = 0, high = 0, now;
+	uint16_t idle_us = ONEWIRE_PRESENCE_SAMPLE_US + resetRecoveryUs;
+
+	*presence_start = 0;
+	*presence_length = 0;
+
+	noInterrupts();
+	DIRECT_MODE_INPUT(reg, mask);
+	interrupts();
+	// wait until the wire is high... just in case
+	do {
+		if (--retries == 0) return 0;
+		delayMicroseconds(2);
+	} while ( !DIRECT_READ(reg, mask));
+
+	noInterrupts();
+	DIRECT_WRITE_LOW(reg, mask);
+	DIRECT_MODE_OUTPUT(reg, mask);	// drive output low
+	interrupts();
+	delayMicroseconds(resetLowUs);
+	noInterrupts();
+	DIRECT_MODE_INPUT(reg, mask);	// allow it to float
+	start = micros();
+	do {
+		now = micros() - start;
+		if (!DIRECT_READ(reg, mask)) {
+			if (!low) low = now ? now : 1;
+		} else if (low) {
+			high = now;
+			break;
+		}
+	} while (now < ONEWIRE_PRESENCE_TIMEOUT_US);
+	interrupts();
+
+	if (low) {
+		if (!high)
+			high = now;
+		*presence_start = low;
+		*presence_length = high - low;
+	}
+	if (now < idle_us)
+		delayMicroseconds(idle_us - now);
+	return low != 0;
+}
+
+void OneWire::set_reset_timing(uint16_t low_us, uint16_t recovery_us)
+{
+	resetLowUs = low_us ? low_us : ONEWIRE_RESET_LOW_US;
+	resetRecoveryUs = recovery_us ? recovery_us : ONEWIRE_RESET_RECOVERY_US;
+}
+
 //
 // Write a bit. Port and bit is used to cut lookup time and provide
 // more certain timing.
@@ -220,22 +283,18 @@ void CRIT_TIMING OneWire::write_bit(uint8_t v)
 		noInterrupts();
 		DIRECT_WRITE_LOW(reg, mask);
 		DIRECT_MODE_OUTPUT(reg, mask);	// drive output low
-		// OBI modification, was 10
-		delayMicroseconds(12);
+		delayMicroseconds(ONEWIRE_WRITE1_LOW_US);
 		DIRECT_WRITE_HIGH(reg, mask);	// drive output high
 		interrupts();
-		// OBI modification, was 55
-		delayMicroseconds(120);
+		delayMicroseconds(ONEWIRE_WRITE1_HIGH_US);
 	} else {
 		noInterrupts();
 		DIRECT_WRITE_LOW(reg, mask);
 		DIRECT_MODE_OUTPUT(reg, mask);	// drive output low
-		// OBI modification, was 65
-		delayMicroseconds(100);
+		delayMicroseconds(ONEWIRE_WRITE0_LOW_US);
 		DIRECT_WRITE_HIGH(reg, mask);	// drive output high
 		interrupts();
-		// OBI modification, was 5
-		delayMicroseconds(30);
+		delayMicroseconds(ONEWIRE_WRITE0_HIGH_US);
 	}
 }
 
@@ -252,16 +311,225 @@ uint8_t CRIT_TIMING OneWire::read_bit(void)
 	noInterrupts();
 	DIRECT_MODE_OUTPUT(reg, mask);
 	DIRECT_WRITE_LOW(reg, mask);
-	// OBI modification, was 3
-	delayMicroseconds(10);
+	delayMicroseconds(ONEWIRE_READ_LOW_US);
 	DIRECT_MODE_INPUT(reg, mask);	// let pin float, pull up will raise
-	delayMicroseconds(10);
+	delayMicroseconds(ONEWIRE_SAMPLE_US);
 	r = DIRECT_READ(reg, mask);
 	interrupts();
-	delayMicroseconds(53);
+	delayMicroseconds(ONEWIRE_READ_HIGH_US - ONEWIRE_SAMPLE_US);
 	return r;
 }
 
+//
+// Read a bit and time the release edge. The pin isn't an input capture pin
+// on the boards OBI uses, so the line is polled: on AVR against Timer1 run
+// as a cycle counter for the duration of the slot, elsewhere against micros().
+//
+uint8_t CRIT_TIMING OneWire::read_bit_timed(uint8_t *edge)
+{
+	IO_REG_TYPE mask IO_REG_MASK_ATTR = bitmask;
+	__attribute__((unused)) volatile IO_REG_TYPE *reg IO_REG_BASE_ATTR = baseReg;
+	uint16_t elapsed_us;
+	uint8_t quarters;
+
+#if defined(__AVR__)
+	const uint16_t ticks_per_us = F_CPU / 1000000;
+	const uint16_t timeout = ONEWIRE_EDGE_TIMEOUT_US * ticks_per_us;
+	uint16_t ticks;
+	uint8_t tccr1a = TCCR1A;
+	uint8_t tccr1b = TCCR1B;
+	TCCR1A = 0;
+	TCCR1B = _BV(CS10);
+#else
+	uint32_t start;
+#endif
+
+	noInterrupts();
+	DIRECT_MODE_OUTPUT(reg, mask);
+	DIRECT_WRITE_LOW(reg, mask);
+	delayMicroseconds(ONEWIRE_READ_LOW_US);
+	DIRECT_MODE_INPUT(reg, mask);	// let pin float, pull up will raise
+#if defined(__AVR__)
+	TCNT1 = 0;
+	while (!DIRECT_READ(reg, mask) && TCNT1 < timeout) ;
+	ticks = TCNT1;
+	interrupts();
+	TCCR1A = tccr1a;
+	TCCR1B = tccr1b;
+	elapsed_us = ticks / ticks_per_us;
+	quarters = ticks < timeout ? ticks * 4 / ticks_per_us : 0xFF;
+#else
+	start = micros();
+	while (!DIRECT_READ(reg, mask) && micros() - start < ONEWIRE_EDGE_TIMEOUT_US) ;
+	elapsed_us = micros() - start;
+	interrupts();
+	quarters = elapsed_us < ONEWIRE_EDGE_TIMEOUT_US ? elapsed_us * 4 : 0xFF;
+#endif
+
+	*edge = quarters;
+	// Keep the slot as long as a read_bit() slot
+	if (elapsed_us < ONEWIRE_READ_HIGH_US)
+		delayMicroseconds(ONEWIRE_READ_HIGH_US - elapsed_us);
+	// Same value read_bit() would have sampled
+	return quarters <= ONEWIRE_SAMPLE_US * 4;
+}
+
+#if defined(__AVR__)
+//
+// OBI modification: byte level slot routines for AVR. The 8 slots are
+// unrolled by the assembler and every delay is a cycle counted loop, so the
+// slot timing doesn't stretch with the call, loop and branch overhead of
+// write_bit() and read_bit(). Interrupts are only off from the falling edge
+// to the rising edge of a write slot and to the sample of a read slot, an
+// interrupt in the high part of a slot only makes the slot longer.
+//
+// Cycle counts are those of the ATmega328P. Edges happen on the std to the
+// port or direction register, so each delay is its slot time less the
+// cycles of the instructions between the two edges. Before the slots the
+// line is put in the state it is left in between them, driven high for a
+// write and released with PORT low for a read, so every slot falls on the
+// same std and not on the first one of a byte only:
+//
+//   write:  cli, PORT low (5), sbrs/rjmp (2 for a 1, 3 for a 0), delay,
+//           PORT high (5), sei, delay, rjmp (1 only)
+//   read:   cli, DDR out (5), delay, DDR in (5), delay, ld (2), sei, and,
+//           breq/ori (2 either way), delay
+//
+#define OW_CYCLES_PER_US (F_CPU / 1000000UL)
+#define OW_CYCLES(us, overhead) ((us) * OW_CYCLES_PER_US - (overhead))
+
+// A loop of 4 cycles per count plus 0-3 nops, 4 * n + 1 + r cycles in all
+#define OW_DELAY(name) \
+	"ldi %A[cnt], lo8(%[" name "_n])\n\t" \
+	"ldi %B[cnt], hi8(%[" name "_n])\n\t" \
+	"3: sbiw %[cnt], 1\n\t" \
+	"brne 3b\n\t" \
+	".rept %[" name "_r]\n\t" \
+	"nop\n\t" \
+	".endr\n\t"
+#define OW_DELAY_ARGS(name, cycles) \
+	[name##_n] "i" (((cycles) - 1) / 4), [name##_r] "i" (((cycles) - 1) % 4)
+
+#define OW_WRITE1_LOW   OW_CYCLES(ONEWIRE_WRITE1_LOW_US, 7)
+#define OW_WRITE1_HIGH  OW_CYCLES(ONEWIRE_WRITE1_HIGH_US, 9)
+#define OW_WRITE0_LOW   OW_CYCLES(ONEWIRE_WRITE0_LOW_US, 8)
+#define OW_WRITE0_HIGH  OW_CYCLES(ONEWIRE_WRITE0_HIGH_US, 7)
+#define OW_READ_LOW     OW_CYCLES(ONEWIRE_READ_LOW_US, 5)
+#define OW_READ_SAMPLE  OW_CYCLES(ONEWIRE_SAMPLE_US, 2)
+#define OW_READ_HIGH    OW_CYCLES(ONEWIRE_READ_HIGH_US - ONEWIRE_SAMPLE_US, 10)
+
+static_assert(OW_WRITE1_LOW >= 5 && OW_WRITE1_HIGH >= 5 && OW_WRITE0_LOW >= 5 && OW_WRITE0_HIGH >= 5 &&
+	OW_READ_LOW >= 5 && OW_READ_SAMPLE >= 5 && OW_READ_HIGH >= 5, "1-Wire slot times too short for the delay loop");
+
+void CRIT_TIMING OneWire::write_slots(uint8_t v)
+{
+	IO_REG_TYPE mask IO_REG_MASK_ATTR = bitmask;
+	volatile IO_REG_TYPE *reg IO_REG_BASE_ATTR = baseReg;
+	IO_REG_TYPE inv = ~mask;
+	uint16_t cnt;
+	uint8_t tmp;
+
+	asm volatile(
+		"cli\n\t"
+		"ldd %[tmp], Z+2\n\t"		// PORT high, pull up or drive
+		"or %[tmp], %[mask]\n\t"
+		"std Z+2, %[tmp]\n\t"
+		"ldd %[tmp], Z+1\n\t"		// DDR out, the line is driven high
+		"or %[tmp], %[mask]\n\t"
+		"std Z+1, %[tmp]\n\t"
+		"sei\n\t"
+		".irp bit,0,1,2,3,4,5,6,7\n\t"
+		"cli\n\t"
+		"ldd %[tmp], Z+2\n\t"		// PORT low, the line falls
+		"and %[tmp], %[inv]\n\t"
+		"std Z+2, %[tmp]\n\t"
+		"sbrs %[v], \\bit\n\t"
+		"rjmp 0f\n\t"
+		OW_DELAY("w1l")
+		"ldd %[tmp], Z+2\n\t"		// PORT high, the line rises
+		"or %[tmp], %[mask]\n\t"
+		"std Z+2, %[tmp]\n\t"
+		"sei\n\t"
+		OW_DELAY("w1h")
+		"rjmp 1f\n\t"
+		"0:\n\t"
+		OW_DELAY("w0l")
+		"ldd %[tmp], Z+2\n\t"		// PORT high, the line rises
+		"or %[tmp], %[mask]\n\t"
+		"std Z+2, %[tmp]\n\t"
+		"sei\n\t"
+		OW_DELAY("w0h")
+		"1:\n\t"
+		".endr\n\t"
+		: [cnt] "=&w" (cnt), [tmp] "=&r" (tmp)
+		: [reg] "z" (reg), [mask] "r" (mask), [inv] "r" (inv), [v] "r" (v),
+		  OW_DELAY_ARGS(w1l, OW_WRITE1_LOW), OW_DELAY_ARGS(w1h, OW_WRITE1_HIGH),
+		  OW_DELAY_ARGS(w0l, OW_WRITE0_LOW), OW_DELAY_ARGS(w0h, OW_WRITE0_HIGH)
+		: "memory");
+}
+
+uint8_t CRIT_TIMING OneWire::read_slots(void)
+{
+	IO_REG_TYPE mask IO_REG_MASK_ATTR = bitmask;
+	volatile IO_REG_TYPE *reg IO_REG_BASE_ATTR = baseReg;
+	IO_REG_TYPE inv = ~mask;
+	uint16_t cnt;
+	uint8_t tmp;
+	uint8_t r = 0;
+
+	asm volatile(
+		"cli\n\t"
+		"ldd %[tmp], Z+1\n\t"		// DDR in, release the line
+		"and %[tmp], %[inv]\n\t"
+		"std Z+1, %[tmp]\n\t"
+		"ldd %[tmp], Z+2\n\t"		// PORT low, no pull up
+		"and %[tmp], %[inv]\n\t"
+		"std Z+2, %[tmp]\n\t"
+		"sei\n\t"
+		".irp bit,0,1,2,3,4,5,6,7\n\t"
+		"cli\n\t"
+		"ldd %[tmp], Z+1\n\t"		// DDR out, the line falls
+		"or %[tmp], %[mask]\n\t"
+		"std Z+1, %[tmp]\n\t"
+		OW_DELAY("rl")
+		"ldd %[tmp], Z+1\n\t"		// DDR in, let the pull up raise the line
+		"and %[tmp], %[inv]\n\t"
+		"std Z+1, %[tmp]\n\t"
+		OW_DELAY("rs")
+		"ld %[tmp], Z\n\t"		// sample
+		"sei\n\t"
+		"and %[tmp], %[mask]\n\t"
+		"breq 0f\n\t"
+		"ori %[r], 1 << \\bit\n\t"
+		"0:\n\t"
+		OW_DELAY("rh")
+		".endr\n\t"
+		: [cnt] "=&w" (cnt), [tmp] "=&r" (tmp), [r] "+d" (r)
+		: [reg] "z" (reg), [mask] "r" (mask), [inv] "r" (inv),
+		  OW_DELAY_ARGS(rl, OW_READ_LOW), OW_DELAY_ARGS(rs, OW_READ_SAMPLE),
+		  OW_DELAY_ARGS(rh, OW_READ_HIGH)
+		: "memory");
+	return r;
+}
+#else
+void OneWire::write_slots(uint8_t v)
+{
+	for (uint8_t bitMask = 0x01; bitMask; bitMask <<= 1) {
+		write_bit((bitMask & v) ? 1 : 0);
+	}
+}
+
+uint8_t OneWire::read_slots(void)
+{
+	uint8_t r = 0;
+
+	for (uint8_t bitMask = 0x01; bitMask; bitMask <<= 1) {
+		if (read_bit()) r |= bitMask;
+	}
+	return r;
+}
+#endif
+
 //
 // Write a byte. The writing code uses the active drivers to raise the
 // pin high, if you need power after the write (e.g. DS18S20 in
@@ -270,11 +538,7 @@ uint8_t CRIT_TIMING OneWire::read_bit(void)
 // other mishap.
 //
 void OneWire::write(uint8_t v, uint8_t power /* = 0 */) {
-    uint8_t bitMask;
-
-    for (bitMask = 0x01; bitMask; bitMask <<= 1) {
-	OneWire::write_bit( (bitMask & v)?1:0);
-    }
+    write_slots(v);
     if ( !power) {
 	noInterrupts();
 	DIRECT_MODE_INPUT(baseReg, bitmask);
@@ -283,9 +547,12 @@ void OneWire::write(uint8_t v, uint8_t power /* = 0 */) {
     }
 }
 
-void OneWire::write_bytes(const uint8_t *buf, uint16_t count, bool power /* = 0 */) {
-  for (uint16_t i = 0 ; i < count ; i++)
+void OneWire::write_bytes(const uint8_t *buf, uint16_t count, bool power /* = 0 */, uint16_t gap_us /* = 0 */) {
+  for (uint16_t i = 0 ; i < count ; i++) {
+    if (gap_us)
+      delayMicroseconds(gap_us);
     write(buf[i]);
+  }
   if (!power) {
     noInterrupts();
     DIRECT_MODE_INPUT(baseReg, bitmask);
@@ -301,15 +568,39 @@ uint8_t OneWire::read() {
     uint8_t bitMask;
     uint8_t r = 0;
 
-    for (bitMask = 0x01; bitMask; bitMask <<= 1) {
-	if ( OneWire::read_bit()) r |= bitMask;
+    if (timingLeft >= 2) {
+	uint8_t rise = 0xFF;
+	uint8_t release = 0xFF;
+	uint8_t edge;
+
+	for (bitMask = 0x01; bitMask; bitMask <<= 1) {
+	    if (OneWire::read_bit_timed(&edge)) {
+		r |= bitMask;
+		if (rise == 0xFF || edge > rise) rise = edge;
+	    } else if (edge < release) {
+		release = edge;
+	    }
+	}
+	*timingLog++ = rise;
+	*timingLog++ = release;
+	timingLeft -= 2;
+	return r;
     }
-    return r;
+
+    return read_slots();
+}
+
+void OneWire::timing_log(uint8_t *log, uint8_t size) {
+    timingLog = log;
+    timingLeft = log ? size : 0;
 }
 
-void OneWire::read_bytes(uint8_t *buf, uint16_t count) {
-  for (uint16_t i = 0 ; i < count ; i++)
+void OneWire::read_bytes(uint8_t *buf, uint16_t count, uint16_t gap_us /* = 0 */) {
+  for (uint16_t i = 0 ; i < count ; i++) {
+    if (gap_us)
+      delayMicroseconds(gap_us);
     buf[i] = read();
+  }
 }
 
 //
@@ -512,7 +803,57 @@ bool OneWire::search(uint8_t *newAddr, bool search_mode /* = true */)
 // "Understanding and Using Cyclic Redundancy Checks with Maxim iButton Products"
 //
 
-#if ONEWIRE_CRC8_TABLE
+#if ONEWIRE_CRC8_TABLE == 2
+// Dow-CRC using polynomial X^8 + X^5 + X^4 + X^0
+// OBI modification, full 256 entry table: one flash read per byte
+static const uint8_t PROGMEM dscrc_table[] = {
+	0x00, 0x5E, 0xBC, 0xE2, 0x61, 0x3F, 0xDD, 0x83,
+	0xC2, 0x9C, 0x7E, 0x20, 0xA3, 0xFD, 0x1F, 0x41,
+	0x9D, 0xC3, 0x21, 0x7F, 0xFC, 0xA2, 0x40, 0x1E,
+	0x5F, 0x01, 0xE3, 0xBD, 0x3E, 0x60, 0x82, 0xDC,
+	0x23, 0x7D, 0x9F, 0xC1, 0x42, 0x1C, 0xFE, 0xA0,
+	0xE1, 0xBF, 0x5D, 0x03, 0x80, 0xDE, 0x3C, 0x62,
+	0xBE, 0xE0, 0x02, 0x5C, 0xDF, 0x81, 0x63, 0x3D,
+	0x7C, 0x22, 0xC0, 0x9E, 0x1D, 0x43, 0xA1, 0xFF,
+	0x46, 0x18, 0xFA, 0xA4, 0x27, 0x79, 0x9B, 0xC5,
+	0x84, 0xDA, 0x38, 0x66, 0xE5, 0xBB, 0x59, 0x07,
+	0xDB, 0x85, 0x67, 0x39, 0xBA, 0xE4, 0x06, 0x58,
+	0x19, 0x47, 0xA5, 0xFB, 0x78, 0x26, 0xC4, 0x9A,
+	0x65, 0x3B, 0xD9, 0x87, 0x04, 0x5A, 0xB8, 0xE6,
+	0xA7, 0xF9, 0x1B, 0x45, 0xC6, 0x98, 0x7A, 0x24,
+	0xF8, 0xA6, 0x44, 0x1A, 0x99, 0xC7, 0x25, 0x7B,
+	0x3A, 0x64, 0x86, 0xD8, 0x5B, 0x05, 0xE7, 0xB9,
+	0x8C, 0xD2, 0x30, 0x6E, 0xED, 0xB3, 0x51, 0x0F,
+	0x4E, 0x10, 0xF2, 0xAC, 0x2F, 0x71, 0x93, 0xCD,
+	0x11, 0x4F, 0xAD, 0xF3, 0x70, 0x2E, 0xCC, 0x92,
+	0xD3, 0x8D, 0x6F, 0x31, 0xB2, 0xEC, 0x0E, 0x50,
+	0xAF, 0xF1, 0x13, 0x4D, 0xCE, 0x90, 0x72, 0x2C,
+	0x6D, 0x33, 0xD1, 0x8F, 0x0C, 0x52, 0xB0, 0xEE,
+	0x32, 0x6C, 0x8E, 0xD0, 0x53, 0x0D, 0xEF, 0xB1,
+	0xF0, 0xAE, 0x4C, 0x12, 0x91, 0xCF, 0x2D, 0x73,
+	0xCA, 0x94, 0x76, 0x28, 0xAB, 0xF5, 0x17, 0x49,
+	0x08, 0x56, 0xB4, 0xEA, 0x69, 0x37, 0xD5, 0x8B,
+	0x57, 0x09, 0xEB, 0xB5, 0x36, 0x68, 0x8A, 0xD4,
+	0x95, 0xCB, 0x29, 0x77, 0xF4, 0xAA, 0x48, 0x16,
+	0xE9, 0xB7, 0x55, 0x0B, 0x88, 0xD6, 0x34, 0x6A,
+	0x2B, 0x75, 0x97, 0xC9, 0x4A, 0x14, 0xF6, 0xA8,
+	0x74, 0x2A, 0xC8, 0x96, 0x15, 0x4B, 0xA9, 0xF7,
+	0xB6, 0xE8, 0x0A, 0x54, 0xD7, 0x89, 0x6B, 0x35
+};
+
+// Compute a Dallas Semiconductor 8 bit CRC. These show up in the ROM
+// and the registers.  (Use the full 256 entry CRC table)
+uint8_t OneWire::crc8(const uint8_t *addr, uint8_t len)
+{
+	uint8_t crc = 0;
+
+	while (len--) {
+		crc = pgm_read_byte(dscrc_table + (crc ^ *addr++));
+	}
+
+	return crc;
+}
+#elif ONEWIRE_CRC8_TABLE
 // Dow-CRC using polynomial X^8 + X^5 + X^4 + X^0
 // Tiny 2x16 entry CRC table created by Arjen Lentz
 // See http://lentz.com.au/blog/calculating-crc-with-a-tiny-32-entry-lookup-table
@@ -40,11 +40,47 @@
 // by setting this to 1.  The lookup table enlarges code size by
 // about 250 bytes.  It does NOT consume RAM (but did in very
 // old versions of OneWire).  If you disable this, a slower
-// but very compact algorithm is used.
+// but very compact algorithm is used. Set it to 2 for a full 256 entry
+// table, one flash read per byte instead of two, for another 224 bytes.
 #ifndef ONEWIRE_CRC8_TABLE
 #define ONEWIRE_CRC8_TABLE 1
 #endif
 
+// Default reset() timing, the 1-Wire standard is 480/410 us.
+// OBI modification, packs need a longer reset low time.
+#ifndef ONEWIRE_RESET_LOW_US
+#define ONEWIRE_RESET_LOW_US 750
+#endif
+#ifndef ONEWIRE_RESET_RECOVERY_US
+#define ONEWIRE_RESET_RECOVERY_US 410
+#endif
+
+// reset() samples the presence pulse this long after releasing the line
+#define ONEWIRE_PRESENCE_SAMPLE_US 70
+
+// reset_timed() gives up on a presence pulse that hasn't ended by then
+#define ONEWIRE_PRESENCE_TIMEOUT_US 480
+
+// read_bit() samples the line this long after releasing it
+#ifndef ONEWIRE_SAMPLE_US
+#define ONEWIRE_SAMPLE_US 10
+#endif
+
+// Slot timing in us, how long a slot holds the line low and how long it
+// then leaves it high. OBI modification, packs need slower slots than the
+// 1-Wire standard of 10/55 for a 1, 65/5 for a 0 and 3/60 for a read.
+#define ONEWIRE_WRITE1_LOW_US 12
+#define ONEWIRE_WRITE1_HIGH_US 120
+#define ONEWIRE_WRITE0_LOW_US 100
+#define ONEWIRE_WRITE0_HIGH_US 30
+#define ONEWIRE_READ_LOW_US 10
+#define ONEWIRE_READ_HIGH_US 63
+
+// read_bit_timed() stops waiting for the line to go high after this long
+#ifndef ONEWIRE_EDGE_TIMEOUT_US
+#define ONEWIRE_EDGE_TIMEOUT_US 60
+#endif
+
 // You can allow 16-bit CRC checks by defining this to 1
 // (Note that ONEWIRE_CRC must also be 1.)
 #ifndef ONEWIRE_CRC16
@@ -60,6 +96,19 @@ class OneWire
     IO_REG_TYPE bitmask;
     volatile IO_REG_TYPE *baseReg;
 
+    // read() timing log, see timing_log()
+    uint8_t *timingLog;
+    uint8_t timingLeft;
+
+    // reset() timing, see set_reset_timing()
+    uint16_t resetLowUs;
+    uint16_t resetRecoveryUs;
+
+    // The 8 slots of a byte, entered once per byte. On AVR the bits are
+    // unrolled with the slot timing counted in cycles.
+    void write_slots(uint8_t v);
+    uint8_t read_slots(void);
+
 #if ONEWIRE_SEARCH
     // global search state
     unsigned char ROM_NO[8];
@@ -78,6 +127,15 @@ class OneWire
     // bus is shorted or otherwise held low for more than 250uS
     uint8_t reset(void);
 
+    // Perform a reset like reset() and measure the presence pulse: when it
+    // started after the line was released and how long it lasted, in us.
+    // Both are 0 when there was no presence pulse.
+    uint8_t reset_timed(uint16_t *presence_start, uint16_t *presence_length);
+
+    // Set how long reset() holds the line low and how long it waits after
+    // sampling the presence pulse, in us. 0 restores the default.
+    void set_reset_timing(uint16_t low_us, uint16_t recovery_us);
+
     // Issue a 1-Wire rom select command, you do the reset first.
     void select(const uint8_t rom[8]);
 
@@ -90,12 +148,15 @@ class OneWire
     // another read or write.
     void write(uint8_t v, uint8_t power = 0);
 
-    void write_bytes(const uint8_t *buf, uint16_t count, bool power = 0);
+    // Write count bytes. OBI modification: with a gap_us the line is left
+    // idle that long before each byte, for slaves that need time between bytes.
+    void write_bytes(const uint8_t *buf, uint16_t count, bool power = 0, uint16_t gap_us = 0);
 
     // Read a byte.
     uint8_t read(void);
 
-    void read_bytes(uint8_t *buf, uint16_t count);
+    // Read count bytes, gap_us before each one like write_bytes().
+    void read_bytes(uint8_t *buf, uint16_t count, uint16_t gap_us = 0);
 
     // Write a bit. The bus is always left powered at the end, see
     // note in write() about that.
@@ -104,6 +165,19 @@ class OneWire
     // Read a bit.
     uint8_t read_bit(void);
 
+    // Read a bit with the same slot timing as read_bit(), and measure when
+    // the line went high after the master released it, in 1/4 us, or 0xFF
+    // if it stayed low for ONEWIRE_EDGE_TIMEOUT_US. A 1 bit should rise well
+    // before the ONEWIRE_SAMPLE_US sample point and the slave should release
+    // a 0 bit well after it, the distance is the timing margin of the bit.
+    uint8_t read_bit_timed(uint8_t *edge);
+
+    // While a log is set, every read() also measures its bits and appends
+    // two bytes to the log: the latest rise of its 1 bits and the earliest
+    // release of its 0 bits, in 1/4 us, 0xFF when the byte has none. Logging
+    // stops when size bytes are used. Pass NULL to turn it off.
+    void timing_log(uint8_t *log, uint8_t size);
+
     // Stop forcing power onto the bus. You only need to do this if
     // you used the 'power' flag to write() or used a write_bit() call
     // and aren't about to do another read or write. You would rather
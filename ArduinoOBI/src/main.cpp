@@ -1,172 +1,1210 @@
 #include <Arduino.h>
+#include <EEPROM.h>
 #include "OneWire2.h"
+#include "obi_frame.h"
 
 /** Major version number (X.x.x) */
 #define ARDUINO_OBI_VERSION_MAJOR 0
 /** Minor version number (x.X.x) */
-#define ARDUINO_OBI_VERSION_MINOR 2
+#define ARDUINO_OBI_VERSION_MINOR 16
 /** Patch version number (x.x.X) */
-#define ARDUINO_OBI_VERSION_PATCH 1
+#define ARDUINO_OBI_VERSION_PATCH 0
 
 #define ONEWIRE_PIN 6
 #define ENABLE_PIN 8
 
+/* Time the pack needs after power up before it answers on the bus */
+#define PACK_POWER_UP_MS 400
+
+/* Bus idle time before each byte of a command or response, the packs need it */
+#define BYTE_GAP_US 90
+
+/* Frame start bytes */
+#define FRAME_START         0x01
+#define MACRO_INVOKE_START  0x02
+
+/* Interface commands */
+#define CMD_VERSION         0x01
+#define CMD_DEVICE_TIME     0x0A
+#define CMD_SNAPSHOT        0x08
+#define CMD_MACRO_STORE     0x10
+#define CMD_MACRO_INFO      0x11
+#define CMD_BATCH           0x12
+#define CMD_MACRO_BUILTIN   0x13
+#define CMD_JOB_START       0x20
+#define CMD_JOB_STOP        0x21
+#define CMD_JOB_STATUS      0x22
+#define CMD_JOB_READ_LOG    0x23
+#define CMD_CAPTURE         0x40
+#define CMD_STREAM_START    0x50
+#define CMD_STREAM_STOP     0x51
+#define CMD_STREAM_CREDIT   0x53
+#define CMD_FIELD_READ      0x60
+#define CMD_TIMING_MARGINS  0x70
+#define CMD_PRESENCE_TIMING 0x71
+#define CMD_RESET_TIMING    0x72
+
+/* Unsolicited frames sent while a stream is running */
+#define STREAM_FRAME        0x52
+
+/*
+ * 0x33 commands read the ROM ID before sending the command. A ROM ID whose
+ * CRC8 doesn't match is read again, only the ROM phase, the command itself
+ * is sent once. All 0 (a shorted bus, its CRC8 is 0 as well) and all 0xFF
+ * (nothing answering) count as bad reads. Without a good ROM ID the command
+ * isn't sent and the response reads all 0xFF, which the host treats as a
+ * failed request.
+ */
+#define ROM_READ_ATTEMPTS   3
+
+/* Largest step response kept by jobs and captures, plus room for 0x33 ROM bytes */
+#define STEP_MAX_RSP        32
+#define STEP_RSP_BUF        (STEP_MAX_RSP + 8)
+
+/*
+ * Macros are command sequences stored in EEPROM and run in one powered
+ * session by the 2 byte frame {MACRO_INVOKE_START, slot}. A slot holds the
+ * length of its steps followed by the steps, each step laid out like a USB
+ * frame without the start byte: len, rsp_len, cmd, data[len], and then the
+ * CRC8 of the length byte and steps. An erased slot reads 0xFF, a slot whose
+ * CRC8 doesn't match is treated as empty and never powers the pack.
+ */
+#define MACRO_SLOTS         8
+#define MACRO_SLOT_SIZE     64
+#define MACRO_EEPROM_BASE   0
+
+/*
+ * A job runs one step every interval from the device's own timer, with the
+ * pack powered only for the step. The 16 bit words of the step response
+ * selected by the field mask are averaged over `average` runs and logged to
+ * an EEPROM ring as: seq (2 bytes), boot, fields. The job definition is kept
+ * in EEPROM too, so a job survives the reset an Uno does when the host opens
+ * the port, it resumes at boot with the boot counter incremented.
+ *
+ * Job definition: step_len, interval_s (2), average, field_mask (2), boot,
+ * epoch (4, host time at job start), step.
+ */
+#define JOB_EEPROM_BASE     (MACRO_EEPROM_BASE + MACRO_SLOTS * MACRO_SLOT_SIZE)
+#define JOB_DEF_SIZE        32
+#define JOB_HEADER_SIZE     11
+#define JOB_STEP_SIZE       (JOB_DEF_SIZE - JOB_HEADER_SIZE)
+#define JOB_MAX_FIELDS      16
+#define JOB_LOG_BASE        (JOB_EEPROM_BASE + JOB_DEF_SIZE)
+#define JOB_LOG_SIZE        (1024 - JOB_LOG_BASE)
+#define JOB_RECORD_HEADER   3
+#define JOB_SEQ_EMPTY       0xFFFF
+
+/*
+ * A capture runs a step back to back as fast as the bus allows and keeps the
+ * last `pre` samples in a ring until a trigger fires, then takes `post` more
+ * samples and returns the whole window. A sample is the cell words, the
+ * temperature word and the low 16 bits of millis().
+ */
+#define CAPTURE_HEADER      15
+#define CAPTURE_RSP_HEADER  4
+#define CAPTURE_TIMEOUT     0
+#define CAPTURE_CELL_LOW    1
+#define CAPTURE_CELL_HIGH   2
+#define CAPTURE_TEMP_HIGH   3
+#define CAPTURE_SPREAD      4
+
+/*
+ * A stream runs a step every interval_ms with the pack kept powered and
+ * reports by exception: a field is sent only when it has moved more than its
+ * deadband from the value last sent. Every heartbeat_s all fields are sent,
+ * so the host also hears from a pack that doesn't change. Stream frames are
+ * STREAM_FRAME, len, mask of the fields included (2), device time of the
+ * sample in us (low 4 bytes), field values.
+ *
+ * Stream definition: interval_ms (2), heartbeat_s (2), field_mask (2), one
+ * deadband byte per field in the mask, step.
+ *
+ * A host that can fall behind grants credits, one per frame it is ready
+ * for. Without credits, or room in the serial transmit buffer, the stream
+ * keeps sampling but holds its frames back. Fields keep comparing against
+ * the value last sent, so the next frame carries everything that moved
+ * meanwhile: the host loses resolution, not frames. Until the first grant
+ * frames are not limited. Grants get no response, so they don't mix with
+ * the responses the host waits for.
+ */
+#define STREAM_HEADER       6
+#define STREAM_CREDITS_OFF  0xFFFF
+
+/*
+ * Jobs and streams keep the full response of their latest run as a
+ * snapshot, so the host can read the latest values from RAM without waiting
+ * for a power-up and a bus transaction. A run fills the back buffer and then
+ * flips snapshot_front with a single byte store, a reader always sees a
+ * complete snapshot.
+ *
+ * Snapshot response: source, step CRC8, seq (2), age_ms (4), len, data,
+ * padded with 0xFF to the requested length.
+ */
+#define SNAPSHOT_NONE       0
+#define SNAPSHOT_JOB        1
+#define SNAPSHOT_STREAM     2
+#define SNAPSHOT_HEADER     9
+
+/*
+ * Device time is micros() extended to 64 bits, so it doesn't wrap every ~71
+ * minutes. The host reads it with CMD_DEVICE_TIME to fit the offset and drift
+ * of the device clock against its own, and maps the device timestamps of
+ * samples to wall-clock time. device_time_us() has to run at least once per
+ * micros() wrap, loop() and long running commands call it.
+ */
+uint32_t device_time_last = 0;
+uint32_t device_time_high = 0;
 
 OneWire makita(ONEWIRE_PIN);
 
-void cmd_and_read_33(byte *cmd, uint8_t cmd_len, byte *rsp, uint8_t rsp_len) {
-	int i;
-	makita.reset();
-	delayMicroseconds(400);
-	makita.write(0x33,0);
+struct Job {
+    uint8_t step_len;           /* 0 when no job is defined */
+    uint16_t interval_s;
+    uint8_t average;
+    uint16_t field_mask;
+    uint8_t boot;
+    byte step[JOB_STEP_SIZE];
 
-	for (i=0; i < 8; i++) {
-		delayMicroseconds(90);
-		rsp[i] = makita.read();
-	}
+    uint8_t record_size;
+    uint8_t capacity;           /* records in the EEPROM ring */
+    uint16_t next_seq;
+    uint32_t next_run_ms;
+    uint32_t last_record_ms;
+    bool logged_this_boot;
+    uint8_t samples;
+    uint32_t sums[JOB_MAX_FIELDS];
+};
+
+Job job;
+
+struct Stream {
+    bool active;
+    uint16_t interval_ms;
+    uint32_t heartbeat_ms;
+    uint16_t field_mask;
+    uint8_t deadband[JOB_MAX_FIELDS];
+    uint16_t sent[JOB_MAX_FIELDS];  /* last value sent for each field */
+    byte step[JOB_STEP_SIZE];
+    uint32_t next_run_ms;
+    uint32_t last_full_ms;
+    uint16_t credits;               /* frames the host is ready for, or STREAM_CREDITS_OFF */
+};
+
+Stream stream;
+
+struct Snapshot {
+    uint8_t source;
+    uint8_t step_crc;           /* CRC8 of the step that produced it */
+    uint8_t len;
+    uint32_t taken_ms;
+    byte data[STEP_RSP_BUF];
+};
+
+Snapshot snapshots[2];
+volatile uint8_t snapshot_front = 0;
+uint16_t snapshot_seq = 0;
+
+/* Reset timing set by the host for the connected pack, 0 for the OneWire defaults */
+uint16_t reset_low_us = 0;
+uint16_t reset_recovery_us = 0;
+/* Gap before each bus byte, set by the host with the reset timing */
+uint16_t byte_gap_us = BYTE_GAP_US;
+
+uint64_t device_time_us() {
+    uint32_t now = micros();
+    if (now < device_time_last)
+        device_time_high++;
+    device_time_last = now;
+    return ((uint64_t)device_time_high << 32) | now;
+}
+
+/* Power the pack and wait for it to start, unless it is powered already */
+void pack_power_on() {
+    if (digitalRead(ENABLE_PIN) == HIGH)
+        return;
+    digitalWrite(ENABLE_PIN, HIGH);
+    delay(PACK_POWER_UP_MS);
+}
+
+/* Drop pack power, unless a running stream needs it */
+void pack_power_off() {
+    if (!stream.active)
+        digitalWrite(ENABLE_PIN, LOW);
+}
 
-	for (i=0; i < cmd_len; i++) {
-		delayMicroseconds(90);
-		makita.write(cmd[i],0);
+/* Keep the response of a job or stream step run as the latest snapshot */
+void snapshot_store(uint8_t source, const byte *step, const byte *rsp) {
+    Snapshot *back = &snapshots[snapshot_front ^ 1];
+
+    /* The response length run_command sends, 0x33 ROM bytes are part of it */
+    back->len = step[1];
+    if (back->len > STEP_RSP_BUF)
+        back->len = STEP_RSP_BUF;
+    back->source = source;
+    back->step_crc = OneWire::crc8(step, step[0] + 3);
+    back->taken_ms = millis();
+    memcpy(back->data, rsp, back->len);
+    snapshot_front ^= 1;
+    snapshot_seq++;
+}
+
+uint8_t snapshot_read(byte *rsp, uint8_t rsp_len) {
+    const Snapshot *front = &snapshots[snapshot_front];
+    uint32_t age = millis() - front->taken_ms;
+
+    if (rsp_len < SNAPSHOT_HEADER)
+        return 0;
+    if (rsp_len > SNAPSHOT_HEADER + STEP_RSP_BUF)
+        rsp_len = SNAPSHOT_HEADER + STEP_RSP_BUF;
+    rsp[0] = front->source;
+    rsp[1] = front->step_crc;
+    rsp[2] = snapshot_seq & 0xFF;
+    rsp[3] = snapshot_seq >> 8;
+    for (uint8_t i = 0; i < 4; i++) {
+        rsp[4 + i] = front->source == SNAPSHOT_NONE ? 0xFF : age >> (8 * i);
+    }
+    rsp[8] = front->len;
+    uint8_t copy = rsp_len - SNAPSHOT_HEADER;
+    memset(&rsp[SNAPSHOT_HEADER], 0xFF, copy);
+    if (copy > front->len)
+        copy = front->len;
+    memcpy(&rsp[SNAPSHOT_HEADER], front->data, copy);
+    return rsp_len;
+}
+
+/* Reset the bus and read the ROM ID into rom, again while its CRC8 doesn't match. Returns true for a valid ROM ID. */
+bool read_rom(byte *rom) {
+	for (uint8_t attempt = 0; attempt < ROM_READ_ATTEMPTS; attempt++) {
+		makita.reset();
+		delayMicroseconds(400);
+		makita.write(0x33,0);
+		makita.read_bytes(rom, 8, byte_gap_us);
+		bool zeros = true;
+		bool ones = true;
+		for (uint8_t i = 0; i < 8; i++) {
+			zeros &= rom[i] == 0x00;
+			ones &= rom[i] == 0xFF;
+		}
+		if (!zeros && !ones && OneWire::crc8(rom, 7) == rom[7])
+			return true;
 	}
+	return false;
+}
 
-	for (i=8; i < rsp_len + 8; i++) {
-		delayMicroseconds(90);
-		rsp[i] = makita.read();
+void cmd_and_read_33(byte *cmd, uint8_t cmd_len, byte *rsp, uint8_t rsp_len) {
+	if (!read_rom(rsp)) {
+		memset(rsp, 0xFF, 8 + rsp_len);
+		return;
 	}
+	makita.write_bytes(cmd, cmd_len, 0, byte_gap_us);
+	makita.read_bytes(&rsp[8], rsp_len, byte_gap_us);
 }
 
 void cmd_and_read_cc(byte *cmd, uint8_t cmd_len, byte *rsp, uint8_t rsp_len) {
-	int i;
 	makita.reset();
 	delayMicroseconds(400);
 	makita.write(0xcc,0);
-
-	for (i=0; i < cmd_len; i++) {
-		delayMicroseconds(90);
-		makita.write(cmd[i],0);
-	}
-
-	for (i=0; i < rsp_len; i++) {
-		delayMicroseconds(90);
-		rsp[i] = makita.read();
-	}
+	makita.write_bytes(cmd, cmd_len, 0, byte_gap_us);
+	makita.read_bytes(rsp, rsp_len, byte_gap_us);
 }
 
 void cmd_and_read(byte *cmd, uint8_t cmd_len, byte *rsp, uint8_t rsp_len) {
-	int i;
 	makita.reset();
 	delayMicroseconds(400);
+	makita.write_bytes(cmd, cmd_len, 0, byte_gap_us);
+	makita.read_bytes(rsp, rsp_len, byte_gap_us);
+}
 
-	for (i=0; i < cmd_len; i++) {
-		delayMicroseconds(90);
-		makita.write(cmd[i],0);
-	}
 
-	for (i=0; i < rsp_len; i++) {
-		delayMicroseconds(90);
-		rsp[i] = makita.read();
-	}
+/*
+ * Run a single command. The response goes to rsp, which must have room for
+ * rsp_len bytes plus the 8 ROM bytes of 0x33 commands. Returns the response
+ * length, 0 for unknown commands.
+ */
+uint8_t run_command(byte cmd, byte *data, uint8_t len, byte *rsp, uint8_t rsp_len) {
+    switch(cmd) {
+        case CMD_VERSION:
+            rsp[0] = ARDUINO_OBI_VERSION_MAJOR;
+            rsp[1] = ARDUINO_OBI_VERSION_MINOR;
+            rsp[2] = ARDUINO_OBI_VERSION_PATCH;
+            break;
+        case 0x31:
+            makita.reset();
+            delayMicroseconds(400);
+            makita.write(0xcc,0);
+            delayMicroseconds(byte_gap_us);
+            makita.write(0x99,0);
+            delay(400);
+            makita.reset();
+            delayMicroseconds(400);
+            makita.write(0x31,0);
+            delayMicroseconds(byte_gap_us);
+            rsp[1] = makita.read();
+            delayMicroseconds(byte_gap_us);
+            rsp[0] = makita.read();
+            delayMicroseconds(byte_gap_us);
+            break;
+        case 0x32:
+            makita.reset();
+            delayMicroseconds(400);
+            makita.write(0xcc,0);
+            delayMicroseconds(byte_gap_us);
+            makita.write(0x99,0);
+            delay(400);
+            makita.reset();
+            delayMicroseconds(400);
+            makita.write(0x32,0);
+            delayMicroseconds(byte_gap_us);
+            rsp[1] = makita.read();
+            delayMicroseconds(byte_gap_us);
+            rsp[0] = makita.read();
+            delayMicroseconds(byte_gap_us);
+            break;
+        case 0x33:
+            cmd_and_read_33(data, len, rsp, rsp_len);
+            break;
+        case 0xCC:
+            cmd_and_read_cc(data, len, rsp, rsp_len);
+            break;
+        default:
+            return 0;
+    }
+    return rsp_len;
+}
+
+/*
+ * Run the macro steps in data, appending each step's response to rsp.
+ * Returns the total response length.
+ */
+uint8_t run_steps(byte *data, uint8_t steps_len, byte *rsp, uint8_t rsp_size) {
+    uint8_t pos = 0;
+    uint8_t rsp_pos = 0;
+
+    while (pos + 3 <= steps_len) {
+        uint8_t len = data[pos];
+        uint8_t rsp_len = data[pos + 1];
+        byte cmd = data[pos + 2];
+
+        /* Stop at malformed steps or responses that don't fit (incl. ROM bytes) */
+        if (pos + 3 + len > steps_len || rsp_pos + rsp_len + 8 > rsp_size)
+            break;
+
+        rsp_pos += run_command(cmd, &data[pos + 3], len, &rsp[rsp_pos], rsp_len);
+        pos += 3 + len;
+    }
+    return rsp_pos;
+}
+
+/*
+ * Built-in macros for common Makita sequences, kept in flash with their CRC8
+ * computed at compile time. They are invoked as slots BUILTIN_MACRO_BASE + n
+ * and work without storing anything in EEPROM.
+ */
+#define BUILTIN_MACRO_BASE  0x80
+
+typedef obi::Step<0x33, 0x09, 0xD9, 0x96, 0xA5> MakitaTestMode;
+typedef obi::Step<0xCC, 0x00, 0x99> MakitaF0513TestMode;
+typedef obi::Step<0x33, 0x09, 0xDA, 0x31> MakitaLedsOn;
+typedef obi::Step<0x33, 0x09, 0xDA, 0x34> MakitaLedsOff;
+typedef obi::Step<0x33, 0x09, 0xDA, 0x04> MakitaResetError;
+
+typedef obi::Macro<MakitaTestMode, MakitaLedsOn> BuiltinLedsOn;
+typedef obi::Macro<MakitaTestMode, MakitaLedsOff> BuiltinLedsOff;
+typedef obi::Macro<MakitaF0513TestMode, MakitaLedsOff> BuiltinF0513LedsOff;
+typedef obi::Macro<MakitaTestMode, MakitaResetError> BuiltinResetError;
+
+struct BuiltinMacro {
+    const uint8_t *data;
+    uint8_t crc;
+};
+
+const BuiltinMacro builtin_macros[] PROGMEM = {
+    { BuiltinLedsOn::data, BuiltinLedsOn::crc8 },
+    { BuiltinLedsOff::data, BuiltinLedsOff::crc8 },
+    { BuiltinF0513LedsOff::data, BuiltinF0513LedsOff::crc8 },
+    { BuiltinResetError::data, BuiltinResetError::crc8 },
+};
+
+#define BUILTIN_MACROS      (sizeof(builtin_macros) / sizeof(builtin_macros[0]))
+
+/* Count of built-in macros and their CRC8s, padded with 0 to rsp_len */
+uint8_t macro_builtin_info(byte *rsp, uint8_t rsp_len) {
+    memset(rsp, 0, rsp_len);
+    if (rsp_len > 0)
+        rsp[0] = BUILTIN_MACROS;
+    for (uint8_t i = 0; i < BUILTIN_MACROS && i + 1 < rsp_len; i++) {
+        rsp[i + 1] = pgm_read_byte(&builtin_macros[i].crc);
+    }
+    return rsp_len;
+}
+
+/*
+ * Load a macro slot into buf (MACRO_SLOT_SIZE bytes) as its length byte
+ * followed by the steps. Returns the steps length, 0 with buf[0] = 0 if the
+ * slot is empty or fails its CRC8.
+ */
+uint8_t macro_load(uint8_t slot, byte *buf) {
+    buf[0] = 0;
+    if (slot >= BUILTIN_MACRO_BASE) {
+        BuiltinMacro macro;
+        uint8_t index = slot - BUILTIN_MACRO_BASE;
+        if (index >= BUILTIN_MACROS)
+            return 0;
+        memcpy_P(&macro, &builtin_macros[index], sizeof(macro));
+        uint8_t steps_len = pgm_read_byte(macro.data);
+        memcpy_P(buf, macro.data, steps_len + 1);
+        return steps_len;
+    }
+    if (slot >= MACRO_SLOTS)
+        return 0;
+
+    int addr = MACRO_EEPROM_BASE + slot * MACRO_SLOT_SIZE;
+    uint8_t steps_len = EEPROM.read(addr);
+
+    /* The length byte, steps and CRC8 must fit in the slot */
+    if (steps_len > MACRO_SLOT_SIZE - 2)
+        return 0;
+    for (uint8_t i = 0; i <= steps_len; i++) {
+        buf[i] = EEPROM.read(addr + i);
+    }
+    if (OneWire::crc8(buf, steps_len + 1) != EEPROM.read(addr + 1 + steps_len)) {
+        buf[0] = 0;
+        return 0;
+    }
+    return steps_len;
+}
+
+/* CRC8 over a slot's length byte and steps, lets the host check a slot without reading it. */
+uint8_t macro_crc(uint8_t slot) {
+    byte buf[MACRO_SLOT_SIZE];
+    uint8_t steps_len = macro_load(slot, buf);
+
+    return OneWire::crc8(buf, steps_len + 1);
+}
+
+/* Store steps in a macro slot, returns the CRC8 of the stored slot. */
+uint8_t macro_store(uint8_t slot, byte *steps, uint8_t steps_len) {
+    int addr = MACRO_EEPROM_BASE + slot * MACRO_SLOT_SIZE;
+    byte buf[MACRO_SLOT_SIZE];
+
+    buf[0] = steps_len;
+    memcpy(&buf[1], steps, steps_len);
+    for (uint8_t i = 0; i <= steps_len; i++) {
+        EEPROM.update(addr + i, buf[i]);
+    }
+    EEPROM.update(addr + 1 + steps_len, OneWire::crc8(buf, steps_len + 1));
+
+    /* Read it back, a slot that didn't store reads as empty */
+    steps_len = macro_load(slot, buf);
+    return OneWire::crc8(buf, steps_len + 1);
+}
+
+uint8_t field_count(uint16_t field_mask) {
+    uint8_t count = 0;
+    for (; field_mask; field_mask >>= 1) {
+        count += field_mask & 1;
+    }
+    return count;
+}
+
+int job_record_addr(uint16_t seq) {
+    return JOB_LOG_BASE + (seq % job.capacity) * job.record_size;
+}
+
+uint16_t job_record_seq(uint8_t index) {
+    int addr = JOB_LOG_BASE + index * job.record_size;
+    return EEPROM.read(addr) | (EEPROM.read(addr + 1) << 8);
+}
+
+void job_prepare() {
+    job.record_size = JOB_RECORD_HEADER + 2 * field_count(job.field_mask);
+    job.capacity = JOB_LOG_SIZE / job.record_size;
+    job.samples = 0;
+    job.logged_this_boot = false;
+    memset(job.sums, 0, sizeof(job.sums));
+    job.next_run_ms = millis();
+}
+
+/* Load the job from EEPROM at boot and continue its log after the newest record. */
+void job_resume() {
+    job.step_len = EEPROM.read(JOB_EEPROM_BASE);
+    if (job.step_len == 0 || job.step_len > JOB_STEP_SIZE) {
+        job.step_len = 0;
+        return;
+    }
+    job.interval_s = EEPROM.read(JOB_EEPROM_BASE + 1) | (EEPROM.read(JOB_EEPROM_BASE + 2) << 8);
+    /* Older firmware accepted an interval of 0, don't resume such a job */
+    if (job.interval_s == 0) {
+        job.step_len = 0;
+        return;
+    }
+    job.average = EEPROM.read(JOB_EEPROM_BASE + 3);
+    job.field_mask = EEPROM.read(JOB_EEPROM_BASE + 4) | (EEPROM.read(JOB_EEPROM_BASE + 5) << 8);
+    job.boot = EEPROM.read(JOB_EEPROM_BASE + 6) + 1;
+    EEPROM.update(JOB_EEPROM_BASE + 6, job.boot);
+    for (uint8_t i = 0; i < job.step_len; i++) {
+        job.step[i] = EEPROM.read(JOB_EEPROM_BASE + JOB_HEADER_SIZE + i);
+    }
+    job_prepare();
+
+    job.next_seq = 0;
+    for (uint8_t i = 0; i < job.capacity; i++) {
+        uint16_t seq = job_record_seq(i);
+        if (seq != JOB_SEQ_EMPTY && seq >= job.next_seq)
+            job.next_seq = seq + 1;
+    }
+}
+
+/* data: interval_s (2), average, field_mask (2), epoch (4), step. Returns the log capacity. */
+uint8_t job_start(byte *data, uint8_t len) {
+    byte *step = &data[9];
+    uint8_t step_len = len - 9;
+
+    if (len < 12 || step_len > JOB_STEP_SIZE || step[0] + 3 != step_len || step[1] > STEP_MAX_RSP || data[2] == 0)
+        return 0;
+    /* An interval of 0 would power cycle the pack and wear the EEPROM log on every loop */
+    if ((data[0] | data[1]) == 0)
+        return 0;
+
+    /* Only fields inside the step response can be logged */
+    uint8_t words = step[1] / 2;
+    uint16_t valid_fields = words >= JOB_MAX_FIELDS ? 0xFFFF : (1U << words) - 1;
+
+    job.step_len = step_len;
+    job.interval_s = data[0] | (data[1] << 8);
+    job.average = data[2];
+    job.field_mask = (data[3] | (data[4] << 8)) & valid_fields;
+    job.boot = 0;
+    memcpy(job.step, step, step_len);
+
+    EEPROM.update(JOB_EEPROM_BASE, step_len);
+    for (uint8_t i = 0; i < 3; i++) {
+        EEPROM.update(JOB_EEPROM_BASE + 1 + i, data[i]);
+    }
+    /* The checked mask, so a resumed job keeps the record layout of its log */
+    EEPROM.update(JOB_EEPROM_BASE + 4, job.field_mask & 0xFF);
+    EEPROM.update(JOB_EEPROM_BASE + 5, job.field_mask >> 8);
+    EEPROM.update(JOB_EEPROM_BASE + 6, job.boot);
+    for (uint8_t i = 0; i < 4; i++) {
+        EEPROM.update(JOB_EEPROM_BASE + 7 + i, data[5 + i]);
+    }
+    for (uint8_t i = 0; i < step_len; i++) {
+        EEPROM.update(JOB_EEPROM_BASE + JOB_HEADER_SIZE + i, job.step[i]);
+    }
+
+    job_prepare();
+    job.next_seq = 0;
+    for (uint8_t i = 0; i < job.capacity; i++) {
+        int addr = JOB_LOG_BASE + i * job.record_size;
+        EEPROM.update(addr, 0xFF);
+        EEPROM.update(addr + 1, 0xFF);
+    }
+    return job.capacity;
+}
+
+void job_stop() {
+    job.step_len = 0;
+    EEPROM.update(JOB_EEPROM_BASE, 0);
+}
+
+/* active, boot, next_seq (2), ms since the last record (4), interval_s (2), average, record size, capacity, epoch (4) */
+uint8_t job_status(byte *rsp) {
+    uint32_t age = job.logged_this_boot ? millis() - job.last_record_ms : 0xFFFFFFFF;
+
+    rsp[0] = job.step_len != 0;
+    rsp[1] = job.boot;
+    rsp[2] = job.next_seq & 0xFF;
+    rsp[3] = job.next_seq >> 8;
+    for (uint8_t i = 0; i < 4; i++) {
+        rsp[4 + i] = age >> (8 * i);
+    }
+    rsp[8] = job.interval_s & 0xFF;
+    rsp[9] = job.interval_s >> 8;
+    rsp[10] = job.average;
+    rsp[11] = job.record_size;
+    rsp[12] = job.capacity;
+    for (uint8_t i = 0; i < 4; i++) {
+        rsp[13 + i] = EEPROM.read(JOB_EEPROM_BASE + 7 + i);
+    }
+    return 17;
+}
+
+/*
+ * Copy `count` records starting at seq into rsp. Records that are not in the
+ * ring (overwritten or not logged yet) read as all 0xFF.
+ */
+uint8_t job_read_log(uint16_t seq, uint8_t count, byte *rsp, uint8_t rsp_size) {
+    uint8_t pos = 0;
+
+    if (job.step_len == 0)
+        return 0;
+    for (; count && pos + job.record_size <= rsp_size; count--, seq++) {
+        bool present = seq < job.next_seq && job.next_seq - seq <= job.capacity;
+        int addr = job_record_addr(seq);
+        for (uint8_t i = 0; i < job.record_size; i++) {
+            rsp[pos++] = present ? EEPROM.read(addr + i) : 0xFF;
+        }
+    }
+    return pos;
 }
 
+/* Run the job step when it is due, called from loop(). */
+void job_tick() {
+    byte rsp[STEP_RSP_BUF];
+    uint8_t len = job.step[0];
+    uint8_t rsp_len = job.step[1];
+
+    if (job.step_len == 0 || (int32_t)(millis() - job.next_run_ms) < 0)
+        return;
+
+    /* Schedule from the previous run time so the interval doesn't drift */
+    job.next_run_ms += (uint32_t)job.interval_s * 1000;
+    if ((int32_t)(millis() - job.next_run_ms) >= 0)
+        job.next_run_ms = millis() + (uint32_t)job.interval_s * 1000;
+
+    pack_power_on();
+    run_command(job.step[2], &job.step[3], len, rsp, rsp_len);
+    pack_power_off();
+    snapshot_store(SNAPSHOT_JOB, job.step, rsp);
+
+    uint8_t field = 0;
+    for (uint8_t word = 0; word < JOB_MAX_FIELDS; word++) {
+        if (job.field_mask & (1U << word)) {
+            job.sums[field++] += rsp[word * 2] | (rsp[word * 2 + 1] << 8);
+        }
+    }
+    if (++job.samples < job.average)
+        return;
+
+    int addr = job_record_addr(job.next_seq);
+    EEPROM.update(addr, job.next_seq & 0xFF);
+    EEPROM.update(addr + 1, job.next_seq >> 8);
+    EEPROM.update(addr + 2, job.boot);
+    for (uint8_t i = 0; i < field; i++) {
+        uint16_t mean = (job.sums[i] + job.average / 2) / job.average;
+        EEPROM.update(addr + JOB_RECORD_HEADER + 2 * i, mean & 0xFF);
+        EEPROM.update(addr + JOB_RECORD_HEADER + 2 * i + 1, mean >> 8);
+        job.sums[i] = 0;
+    }
+    job.samples = 0;
+    job.next_seq++;
+    job.last_record_ms = millis();
+    job.logged_this_boot = true;
+}
+
+uint16_t get_u16(const byte *p) {
+    return p[0] | (p[1] << 8);
+}
+
+void put_u16(byte *p, uint16_t value) {
+    p[0] = value & 0xFF;
+    p[1] = value >> 8;
+}
+
+/* Reverse len bytes in place */
+void reverse_bytes(byte *p, uint8_t len) {
+    for (uint8_t i = 0, j = len - 1; i < j; i++, j--) {
+        byte tmp = p[i];
+        p[i] = p[j];
+        p[j] = tmp;
+    }
+}
+
+/* Trigger reason for a sample, 0 if no threshold is crossed. Thresholds of 0 are disabled. */
+uint8_t capture_trigger(const byte *sample, uint8_t cells, const byte *params) {
+    uint16_t v_min = get_u16(&params[5]);
+    uint16_t v_max = get_u16(&params[7]);
+    uint16_t t_max = get_u16(&params[9]);
+    uint16_t spread_max = get_u16(&params[11]);
+    uint16_t lowest = 0xFFFF;
+    uint16_t highest = 0;
+
+    for (uint8_t i = 0; i < cells; i++) {
+        uint16_t v = get_u16(&sample[2 * i]);
+        if (v < lowest)
+            lowest = v;
+        if (v > highest)
+            highest = v;
+    }
+    if (v_min && lowest < v_min)
+        return CAPTURE_CELL_LOW;
+    if (v_max && highest > v_max)
+        return CAPTURE_CELL_HIGH;
+    if (t_max && get_u16(&sample[2 * cells]) > t_max)
+        return CAPTURE_TEMP_HIGH;
+    if (spread_max && cells && highest - lowest > spread_max)
+        return CAPTURE_SPREAD;
+    return 0;
+}
+
+/*
+ * data: pre, post, first cell word, cell count, temperature word, cell min,
+ * cell max, temperature max, spread max, timeout_s (all 2 bytes), step.
+ * Writes reason, pre count, post count, sample size and the samples, oldest
+ * first, to rsp. The response always has room for pre + post samples, unused
+ * samples read 0xFF. Returns the response length, 0 for bad parameters.
+ * The device can't take requests during a capture, so the timeout is required.
+ */
+uint8_t capture(byte *data, uint8_t len, byte *rsp, uint8_t rsp_size) {
+    byte bus_rsp[STEP_RSP_BUF];
+    byte *step = &data[CAPTURE_HEADER];
+    uint8_t pre = data[0];
+    uint8_t post = data[1];
+    uint8_t first_cell = data[2];
+    uint8_t cells = data[3];
+    uint8_t temp_word = data[4];
+    uint32_t timeout_ms = (uint32_t)get_u16(&data[13]) * 1000;
+    uint8_t sample_size = 2 * cells + 4;
+    byte *samples = &rsp[CAPTURE_RSP_HEADER];
+
+    if (len < CAPTURE_HEADER + 3 || timeout_ms == 0 || step[0] + 3 != len - CAPTURE_HEADER || step[1] > STEP_MAX_RSP || post == 0 ||
+        (first_cell + cells) * 2 > step[1] || (temp_word + 1) * 2 > step[1] ||
+        CAPTURE_RSP_HEADER + (pre + post) * sample_size > rsp_size)
+        return 0;
+
+    uint8_t rsp_len = CAPTURE_RSP_HEADER + (pre + post) * sample_size;
+    memset(rsp, 0xFF, rsp_len);
+
+    uint8_t reason = 0;
+    uint8_t head = 0;
+    uint8_t filled = 0;
+    uint8_t taken = 0;
+    uint32_t start = millis();
+
+    while (taken < post) {
+        device_time_us();
+        run_command(step[2], &step[3], step[0], bus_rsp, step[1]);
+
+        /* Build the sample in the post trigger area, it stays there once triggered */
+        byte *sample = &samples[(pre + taken) * sample_size];
+        memcpy(sample, &bus_rsp[first_cell * 2], cells * 2);
+        memcpy(&sample[cells * 2], &bus_rsp[temp_word * 2], 2);
+        put_u16(&sample[cells * 2 + 2], millis());
+
+        if (!reason)
+            reason = capture_trigger(sample, cells, data);
+        if (reason) {
+            taken++;
+        } else if (pre) {
+            memcpy(&samples[head * sample_size], sample, sample_size);
+            head = (head + 1) % pre;
+            if (filled < pre)
+                filled++;
+        }
+        if (!reason && millis() - start >= timeout_ms) {
+            memset(sample, 0xFF, sample_size);
+            break;
+        }
+    }
+
+    /* Rotate the ring so the oldest pre trigger sample comes first */
+    if (filled == pre && head) {
+        reverse_bytes(samples, head * sample_size);
+        reverse_bytes(&samples[head * sample_size], (pre - head) * sample_size);
+        reverse_bytes(samples, pre * sample_size);
+    }
+    /* Close the gap after a ring that never filled up */
+    if (filled < pre) {
+        memmove(&samples[filled * sample_size], &samples[pre * sample_size], post * sample_size);
+        memset(&samples[(filled + post) * sample_size], 0xFF, (pre - filled) * sample_size);
+    }
+
+    rsp[0] = reason;
+    rsp[1] = filled;
+    rsp[2] = taken;
+    rsp[3] = sample_size;
+    return rsp_len;
+}
+
+void send_usb(byte *rsp, byte rsp_len) {
+    for (int i=0; i < rsp_len; i++) {
+        Serial.write(rsp[i]);
+    }
+}
+
+/*
+ * data: field_mask (2), step. Runs the step but reads the bus only up to the
+ * last selected 16 bit word of its response, then packs the selected words
+ * into rsp. Returns the response length, 0 if the read was rejected.
+ */
+uint8_t field_read(byte *data, uint8_t len, byte *rsp) {
+    byte bus_rsp[STEP_RSP_BUF];
+    uint16_t field_mask = get_u16(data);
+    byte *step = &data[2];
+    uint8_t words = 0;
+    uint8_t pos = 0;
+
+    if (len < 5 || step[0] + 3 != len - 2 || field_mask == 0)
+        return 0;
+
+    for (uint8_t word = 0; word < JOB_MAX_FIELDS; word++) {
+        if (field_mask & (1U << word))
+            words = word + 1;
+    }
+    /* Words count from the start of the step response, which holds the ROM ID for 0x33 */
+    uint8_t rom_len = step[2] == 0x33 ? 8 : 0;
+    uint8_t bus_len = words * 2 > rom_len ? words * 2 - rom_len : 0;
+    if (bus_len > STEP_MAX_RSP)
+        return 0;
+
+    run_command(step[2], &step[3], step[0], bus_rsp, bus_len);
+
+    for (uint8_t word = 0; word < words; word++) {
+        if (field_mask & (1U << word)) {
+            rsp[pos++] = bus_rsp[word * 2];
+            rsp[pos++] = bus_rsp[word * 2 + 1];
+        }
+    }
+    return pos;
+}
+
+/*
+ * data: step. Runs the step with the 1-Wire read slots timed and returns its
+ * response followed by two timing bytes per byte read from the bus, see
+ * OneWire::timing_log(). Returns the response length, 0 if rejected.
+ */
+uint8_t timing_margins(byte *data, uint8_t len, byte *rsp) {
+    if (len < 3 || data[0] + 3 != len || data[1] > STEP_MAX_RSP)
+        return 0;
+
+    /* 0x33 steps read the ROM ID from the bus too */
+    uint8_t bus_len = data[1] + (data[2] == 0x33 ? 8 : 0);
+    memset(&rsp[bus_len], 0xFF, 2 * bus_len);
+
+    makita.timing_log(&rsp[bus_len], 2 * bus_len);
+    run_command(data[2], &data[3], data[0], rsp, data[1]);
+    makita.timing_log(NULL, 0);
+    return 3 * bus_len;
+}
+
+/*
+ * data: optional reset low time (2) to try instead of the current one.
+ * Resets the bus and writes presence, presence start (2) and presence
+ * length (2) in us to rsp. Returns the response length.
+ */
+uint8_t presence_timing(byte *data, uint8_t len, byte *rsp) {
+    uint16_t start;
+    uint16_t length;
+
+    if (len >= 2)
+        makita.set_reset_timing(get_u16(data), reset_recovery_us);
+    rsp[0] = makita.reset_timed(&start, &length);
+    makita.set_reset_timing(reset_low_us, reset_recovery_us);
+
+    put_u16(&rsp[1], start);
+    put_u16(&rsp[3], length);
+    return 5;
+}
+
+/* data: reset low time (2), recovery time (2), optional byte gap (2) in us, 0 for the defaults */
+void set_reset_timing(byte *data, uint8_t len) {
+    reset_low_us = len >= 2 ? get_u16(data) : 0;
+    reset_recovery_us = len >= 4 ? get_u16(&data[2]) : 0;
+    byte_gap_us = len >= 6 && get_u16(&data[4]) ? get_u16(&data[4]) : BYTE_GAP_US;
+    makita.set_reset_timing(reset_low_us, reset_recovery_us);
+}
+
+/* Returns the number of streamed fields, 0 if the stream was rejected. */
+uint8_t stream_start(byte *data, uint8_t len) {
+    uint16_t field_mask = get_u16(&data[4]);
+    uint8_t fields = field_count(field_mask);
+    byte *step = &data[STREAM_HEADER + fields];
+    uint8_t step_len = len - STREAM_HEADER - fields;
+
+    if (len < STREAM_HEADER + fields + 3 || step_len > JOB_STEP_SIZE || step[0] + 3 != step_len ||
+        step[1] > STEP_MAX_RSP || fields == 0 || get_u16(data) == 0)
+        return 0;
+    /* Every field must be inside the step response */
+    for (uint8_t word = step[1] / 2; word < JOB_MAX_FIELDS; word++) {
+        if (field_mask & (1U << word))
+            return 0;
+    }
+
+    stream.interval_ms = get_u16(data);
+    stream.heartbeat_ms = (uint32_t)get_u16(&data[2]) * 1000;
+    stream.field_mask = field_mask;
+    memcpy(stream.deadband, &data[STREAM_HEADER], fields);
+    memcpy(stream.step, step, step_len);
+    stream.next_run_ms = millis();
+    /* The first sample is always sent in full */
+    stream.last_full_ms = millis() - stream.heartbeat_ms;
+    stream.credits = STREAM_CREDITS_OFF;
+    stream.active = true;
+    digitalWrite(ENABLE_PIN, HIGH);
+    return fields;
+}
+
+void stream_stop() {
+    stream.active = false;
+}
+
+/* credits (2), added to the frames the host is ready for */
+void stream_credit(byte *data, uint8_t len) {
+    if (len < 2)
+        return;
+    uint32_t credits = stream.credits == STREAM_CREDITS_OFF ? 0 : stream.credits;
+    credits += get_u16(data);
+    stream.credits = credits >= STREAM_CREDITS_OFF ? STREAM_CREDITS_OFF - 1 : credits;
+}
+
+/* Sample the stream step when it is due and send the fields that moved, called from loop(). */
+void stream_tick() {
+    byte rsp[STEP_RSP_BUF];
+    byte frame[8 + 2 * JOB_MAX_FIELDS];
+
+    if (!stream.active || (int32_t)(millis() - stream.next_run_ms) < 0)
+        return;
+
+    stream.next_run_ms += stream.interval_ms;
+    if ((int32_t)(millis() - stream.next_run_ms) >= 0)
+        stream.next_run_ms = millis() + stream.interval_ms;
+
+    uint32_t taken_us = device_time_us();
+    run_command(stream.step[2], &stream.step[3], stream.step[0], rsp, stream.step[1]);
+    snapshot_store(SNAPSHOT_STREAM, stream.step, rsp);
+
+    if (stream.credits == 0)
+        return;
+
+    bool full = millis() - stream.last_full_ms >= stream.heartbeat_ms;
+    uint16_t changed = 0;
+    uint8_t pos = 8;
+    uint8_t field = 0;
+    for (uint8_t word = 0; word < JOB_MAX_FIELDS; word++) {
+        if (!(stream.field_mask & (1U << word)))
+            continue;
+        uint16_t value = get_u16(&rsp[word * 2]);
+        uint16_t diff = value > stream.sent[field] ? value - stream.sent[field] : stream.sent[field] - value;
+        if (full || diff > stream.deadband[field]) {
+            changed |= 1U << word;
+            put_u16(&frame[pos], value);
+            pos += 2;
+        }
+        field++;
+    }
+    /* Don't block the loop on a full transmit buffer, the values go out with the next frame */
+    if (!changed || Serial.availableForWrite() < pos)
+        return;
+
+    field = 0;
+    for (uint8_t word = 0; word < JOB_MAX_FIELDS; word++) {
+        if (!(stream.field_mask & (1U << word)))
+            continue;
+        if (changed & (1U << word))
+            stream.sent[field] = get_u16(&rsp[word * 2]);
+        field++;
+    }
+    if (full)
+        stream.last_full_ms = millis();
+    if (stream.credits != STREAM_CREDITS_OFF)
+        stream.credits--;
+
+    frame[0] = STREAM_FRAME;
+    frame[1] = pos - 2;
+    put_u16(&frame[2], changed);
+    for (uint8_t i = 0; i < 4; i++) {
+        frame[4 + i] = taken_us >> (8 * i);
+    }
+    send_usb(frame, pos);
+}
 
 void setup() {
 	Serial.begin (9600);
     // One-wire
 	pinMode(ENABLE_PIN, OUTPUT);
 	//pinMode(2, OUTPUT);
+	job_resume();
 }
 
-void send_usb(byte *rsp, byte rsp_len) {
-    for (int i=0; i < rsp_len; i++) {
-        Serial.write(rsp[i]);
+/*
+ * What each command needs besides the firmware itself. Commands that only
+ * touch RAM and EEPROM answer right away, without powering the pack.
+ * Commands not in the table run entirely in firmware.
+ */
+#define RES_NONE    0x00
+#define RES_BUS     0x01    /* powers the pack and talks on the 1-Wire bus */
+
+struct CommandResources {
+    uint8_t cmd;
+    uint8_t resources;
+};
+
+const CommandResources command_table[] PROGMEM = {
+    { CMD_VERSION,          RES_NONE },
+    { CMD_DEVICE_TIME,      RES_NONE },
+    { CMD_SNAPSHOT,         RES_NONE },
+    { CMD_MACRO_STORE,      RES_NONE },
+    { CMD_MACRO_INFO,       RES_NONE },
+    { CMD_BATCH,            RES_BUS },
+    { CMD_MACRO_BUILTIN,    RES_NONE },
+    { CMD_JOB_START,        RES_NONE },     /* job_tick() powers the pack for each run */
+    { CMD_JOB_STOP,         RES_NONE },
+    { CMD_JOB_STATUS,       RES_NONE },
+    { CMD_JOB_READ_LOG,     RES_NONE },
+    { 0x31,                 RES_BUS },
+    { 0x32,                 RES_BUS },
+    { 0x33,                 RES_BUS },
+    { CMD_CAPTURE,          RES_BUS },
+    { CMD_STREAM_START,     RES_BUS },      /* the first sample is taken right away */
+    { CMD_STREAM_STOP,      RES_NONE },
+    { CMD_STREAM_CREDIT,    RES_NONE },
+    { CMD_FIELD_READ,       RES_BUS },
+    { CMD_TIMING_MARGINS,   RES_BUS },
+    { CMD_PRESENCE_TIMING,  RES_BUS },
+    { CMD_RESET_TIMING,     RES_NONE },
+    { 0xCC,                 RES_BUS },
+};
+
+uint8_t command_resources(byte cmd) {
+    for (uint8_t i = 0; i < sizeof(command_table) / sizeof(command_table[0]); i++) {
+        if (pgm_read_byte(&command_table[i].cmd) == cmd)
+            return pgm_read_byte(&command_table[i].resources);
     }
+    return RES_NONE;
 }
 
 void read_usb() {
-    if (Serial.available() >= 4) {
-        byte start = Serial.read();
-        byte cmd;
-        byte len;
-        byte data[255];
-        byte rsp[255];
-        byte rsp_len;
-
-        if (start == 0x01) {
-            len = Serial.read();
-            rsp_len = Serial.read();
-            cmd = Serial.read();
-            if (len > 0){
-                for (int i = 0; i < len; i++) {
-                    while (Serial.available() < 1);
-                    data[i] = Serial.read();
-                }
-            }
+    if (Serial.available() < 2)
+        return;
+
+    byte start = Serial.peek();
+    byte cmd;
+    byte len = 0;
+    byte data[255];
+    byte rsp[255];
+    byte rsp_len;
+
+    if (start == MACRO_INVOKE_START) {
+        Serial.read();
+        byte slot = Serial.read();
+
+        /* Empty and corrupt slots answer with no steps run, the pack stays off */
+        len = macro_load(slot, data);
+        rsp[0] = MACRO_INVOKE_START;
+        rsp[1] = 0;
+        if (len > 0) {
+            pack_power_on();
+            rsp[1] = run_steps(&data[1], len, &rsp[2], sizeof(rsp) - 2);
+            pack_power_off();
         }
-        else {
-            return;
+        send_usb(rsp, rsp[1] + 2);
+        return;
+    }
+    if (start != FRAME_START) {
+        Serial.read();
+        return;
+    }
+    if (Serial.available() < 4)
+        return;
+
+    Serial.read();
+    len = Serial.read();
+    rsp_len = Serial.read();
+    cmd = Serial.read();
+    if (len > 0){
+        for (int i = 0; i < len; i++) {
+            while (Serial.available() < 1);
+            data[i] = Serial.read();
         }
-        /* Set RTS */
-    	digitalWrite(ENABLE_PIN, HIGH);
-	    delay(400);
-
-        switch(cmd) {
-            case 0x01:
-                rsp[0] = 0x01;
-                rsp[2] = ARDUINO_OBI_VERSION_MAJOR;
-                rsp[3] = ARDUINO_OBI_VERSION_MINOR;
-                rsp[4] = ARDUINO_OBI_VERSION_PATCH;
-                break;
-            case 0x31:
-                makita.reset();
-                delayMicroseconds(400);
-                makita.write(0xcc,0);
-                delayMicroseconds(90);
-                makita.write(0x99,0);
-                delay(400);
-                makita.reset();
-                delayMicroseconds(400);
-                makita.write(0x31,0);
-                delayMicroseconds(90);
-                rsp[3] = makita.read();
-                delayMicroseconds(90);
-                rsp[2] = makita.read();
-                delayMicroseconds(90);
-                break;
-            case 0x32:
-                makita.reset();
-                delayMicroseconds(400);
-                makita.write(0xcc,0);
-                delayMicroseconds(90);
-                makita.write(0x99,0);
-                delay(400);
-                makita.reset();
-                delayMicroseconds(400);
-                makita.write(0x32,0);
-                delayMicroseconds(90);
-                rsp[3] = makita.read();
-                delayMicroseconds(90);
-                rsp[2] = makita.read();
-                delayMicroseconds(90);
-                break;
-            case 0x33:
-                cmd_and_read_33(data, len, &rsp[2], rsp_len);
-                break;
-            case 0xCC:
-                cmd_and_read_cc(data, len, &rsp[2], rsp_len);
+    }
+
+    if (command_resources(cmd) & RES_BUS)
+        pack_power_on();
+
+    switch(cmd) {
+        case CMD_DEVICE_TIME: {
+            /* Taken right after the request arrived, the host places it between its request and the response */
+            uint64_t now = device_time_us();
+            for (uint8_t i = 0; i < 8; i++) {
+                rsp[2 + i] = now >> (8 * i);
+            }
+            rsp_len = 8;
+            break;
+        }
+        case CMD_SNAPSHOT:
+            rsp_len = snapshot_read(&rsp[2], rsp_len);
+            break;
+        case CMD_MACRO_STORE:
+            /* slot and steps, the slot keeps a length byte and CRC8 besides the steps */
+            if (len < 1 || data[0] >= MACRO_SLOTS || len > MACRO_SLOT_SIZE - 1) {
+                rsp_len = 0;
                 break;
-            default:
+            }
+            rsp[2] = macro_store(data[0], &data[1], len - 1);
+            rsp_len = 1;
+            break;
+        case CMD_MACRO_INFO:
+            for (uint8_t slot = 0; slot < MACRO_SLOTS; slot++) {
+                rsp[2 + slot] = macro_crc(slot);
+            }
+            rsp_len = MACRO_SLOTS;
+            break;
+        case CMD_BATCH:
+            /* Steps sent with the request, run like a macro in one powered session */
+            rsp_len = run_steps(data, len, &rsp[2], sizeof(rsp) - 2);
+            break;
+        case CMD_MACRO_BUILTIN:
+            rsp_len = macro_builtin_info(&rsp[2], rsp_len);
+            break;
+        case CMD_JOB_START:
+            rsp[2] = job_start(data, len);
+            rsp_len = 1;
+            break;
+        case CMD_JOB_STOP:
+            job_stop();
+            rsp_len = 0;
+            break;
+        case CMD_JOB_STATUS:
+            rsp_len = job_status(&rsp[2]);
+            break;
+        case CMD_CAPTURE:
+            rsp_len = capture(data, len, &rsp[2], sizeof(rsp) - 2);
+            break;
+        case CMD_STREAM_START:
+            rsp[2] = stream_start(data, len);
+            rsp_len = 1;
+            break;
+        case CMD_STREAM_STOP:
+            stream_stop();
+            rsp_len = 0;
+            break;
+        case CMD_STREAM_CREDIT:
+            stream_credit(data, len);
+            return;
+        case CMD_FIELD_READ:
+            rsp_len = field_read(data, len, &rsp[2]);
+            break;
+        case CMD_TIMING_MARGINS:
+            rsp_len = timing_margins(data, len, &rsp[2]);
+            break;
+        case CMD_PRESENCE_TIMING:
+            rsp_len = presence_timing(data, len, &rsp[2]);
+            break;
+        case CMD_RESET_TIMING:
+            set_reset_timing(data, len);
+            rsp_len = 0;
+            break;
+        case CMD_JOB_READ_LOG:
+            if (len < 3) {
                 rsp_len = 0;
                 break;
-        }
-        rsp[0] = cmd;
-        rsp[1] = rsp_len;
-        send_usb(rsp, rsp_len + 2);
-
-        digitalWrite(ENABLE_PIN, LOW);
+            }
+            rsp_len = job_read_log(data[0] | (data[1] << 8), data[2], &rsp[2], sizeof(rsp) - 2);
+            break;
+        default:
+            rsp_len = run_command(cmd, data, len, &rsp[2], rsp_len);
+            break;
     }
+    rsp[0] = cmd;
+    rsp[1] = rsp_len;
+    send_usb(rsp, rsp_len + 2);
+
+    pack_power_off();
 }
 
 void loop() {
+    device_time_us();
     read_usb();
+    job_tick();
+    stream_tick();
 }
@@ -0,0 +1,131 @@
+""" Map device timestamps to wall-clock time.
+
+Host side timestamps carry the USB and scheduling jitter of every transfer,
+and the device's crystal runs a little fast or slow. Instead the device
+stamps its samples with its own clock and the host samples that clock now and
+then: each sample pairs a device time with the wall-clock time in the middle
+of the request's round trip. A linear fit over recent samples gives the offset
+and drift of the device clock, which then maps any device timestamp.
+
+Only the exchange with the shortest round trip of each burst is kept, and
+samples whose round trip is far above the best one in the window are left out
+of the fit, those are the ones the host got to late.
+"""
+
+import collections
+import threading
+import time
+
+SYNC_INTERVAL_S = 60
+# Samples in the fit, an hour at the default interval, so the fit follows drift as temperature changes
+SYNC_WINDOW = 60
+SYNC_BURST = 4
+# Samples with a round trip this many times the best one in the window are not fitted
+RTT_LIMIT = 2.0
+# Request and response of the device time command, in bytes on the wire
+REQUEST_BYTES = 4
+RESPONSE_BYTES = 10
+
+WRAP_32 = 1 << 32
+
+
+class ClockSync:
+    def __init__(self, interface, window=SYNC_WINDOW, burst=SYNC_BURST):
+        self.interface = interface
+        self.burst = burst
+        self.lock = threading.Lock()
+        # (device_us, wall time, round trip)
+        self.samples = collections.deque(maxlen=window)
+        # device_us and wall time of the fit's origin, and wall seconds per device second
+        self.fit = None
+        self.residual = None
+        self.thread = None
+        self.stopping = None
+
+    def exchange(self):
+        """ One device time request, returns device_us, the wall-clock time it was taken and the round trip. """
+        wall = time.time()
+        start = time.perf_counter()
+        device_us = self.interface.device_time()
+        rtt = time.perf_counter() - start
+        # The device reads its clock when the request has arrived, the longer response is still on the wire after it
+        byte_time = 10 / self.interface.serial.baudrate
+        return device_us, wall + rtt / 2 - (RESPONSE_BYTES - REQUEST_BYTES) * byte_time / 2, rtt
+
+    def sample(self):
+        best = min((self.exchange() for _ in range(self.burst)), key=lambda exchange: exchange[2])
+        with self.lock:
+            self.samples.append(best)
+            self.refit()
+        return best
+
+    def refit(self):
+        best_rtt = min(sample[2] for sample in self.samples)
+        samples = [sample for sample in self.samples if sample[2] <= best_rtt * RTT_LIMIT]
+        # Relative to the first sample, so the doubles keep their microseconds
+        device0, wall0 = samples[0][0], samples[0][1]
+        xs = [(device_us - device0) / 1e6 for device_us, _, _ in samples]
+        ys = [wall - wall0 for _, wall, _ in samples]
+        x_mean = sum(xs) / len(xs)
+        y_mean = sum(ys) / len(ys)
+        sxx = sum((x - x_mean) ** 2 for x in xs)
+        # A single sample, or samples taken back to back, only give the offset
+        rate = sum((x - x_mean) * (y - y_mean) for x, y in zip(xs, ys)) / sxx if sxx > 1.0 else 1.0
+        offset = y_mean - rate * x_mean
+        self.fit = (device0, wall0 + offset, rate)
+        self.residual = (sum((y - offset - rate * x) ** 2 for x, y in zip(xs, ys)) / len(xs)) ** 0.5
+
+    def to_wall(self, device_us):
+        """ Wall-clock time of a device time in us, None before the first sample. """
+        fit = self.fit
+        if fit is None:
+            return None
+        device0, wall0, rate = fit
+        return wall0 + rate * (device_us - device0) / 1e6
+
+    def device_now(self):
+        """ Estimated device time in us now, None before the first sample. """
+        fit = self.fit
+        if fit is None:
+            return None
+        device0, wall0, rate = fit
+        return device0 + round((time.time() - wall0) / rate * 1e6)
+
+    def expand(self, device_us_low):
+        """ The full device time of a timestamp that only has its low 32 bits, the one nearest to now. """
+        now = self.device_now()
+        if now is None:
+            return None
+        delta = (device_us_low - now) % WRAP_32
+        if delta >= WRAP_32 // 2:
+            delta -= WRAP_32
+        return now + delta
+
+    def stats(self):
+        fit = self.fit
+        return {'samples': len(self.samples),
+                # Positive when the device clock runs fast
+                'drift_ppm': None if fit is None else (1 / fit[2] - 1) * 1e6,
+                'residual_s': self.residual,
+                'rtt_s': min((sample[2] for sample in self.samples), default=None)}
+
+    def start(self, interval_s=SYNC_INTERVAL_S):
+        """ Sample in a background thread every interval_s, the first time right away. """
+        if self.thread:
+            return
+        self.stopping = threading.Event()
+        self.thread = threading.Thread(target=self.run, args=(interval_s, self.stopping), daemon=True)
+        self.thread.start()
+
+    def stop(self):
+        thread, self.thread = self.thread, None
+        if thread:
+            self.stopping.set()
+
+    def run(self, interval_s, stopping):
+        while not stopping.is_set():
+            try:
+                self.sample()
+            except Exception as e:
+                self.interface.obi_instance.update_debug(f"Clock sync failed: {e}")
+            stopping.wait(interval_s)
@@ -0,0 +1,108 @@
+""" Request coalescing for read-only requests.
+
+When the GUI, a logger and a test plan ask the same pack for the same data
+at the same time, only the first request goes to the device, the others wait
+for it and share its response. A response can also be served again for a
+short freshness window, so back to back readers don't each pay a power-up.
+
+Only frames registered as read-only are coalesced, the interface can't know
+which pack commands change state. Any other request may change what the pack
+answers, so it clears the cached responses.
+"""
+
+import threading
+import time
+
+
+class Flight:
+    def __init__(self):
+        self.done = threading.Event()
+        self.response = None
+        self.error = None
+
+
+class RequestCoalescer:
+    def __init__(self):
+        self.lock = threading.Lock()
+        # (frame, rsp_len) -> freshness window in seconds
+        self.read_only = {}
+        self.in_flight = {}
+        self.cache = {}
+        self.shared = 0
+        self.cached = 0
+
+    @staticmethod
+    def key(frame, rsp_len):
+        return bytes(frame), rsp_len
+
+    def register(self, frame, freshness_s=0.0, rsp_len=None):
+        """ Mark a request as read-only, responses are reused for freshness_s seconds. """
+        with self.lock:
+            self.read_only[self.key(frame, frame[2] if rsp_len is None else rsp_len)] = freshness_s
+
+    def freshness(self, frame, rsp_len):
+        """ Freshness window of a registered read-only request, None for any other request. """
+        return self.read_only.get(self.key(frame, rsp_len))
+
+    def invalidate(self):
+        with self.lock:
+            self.cache.clear()
+
+    def lookup(self, frame, rsp_len, freshness_s):
+        """ A response to the request no older than freshness_s, or None. """
+        with self.lock:
+            entry = self.cache.get(self.key(frame, rsp_len))
+            if entry and time.monotonic() - entry[0] <= freshness_s:
+                self.cached += 1
+                return entry[1]
+        return None
+
+    def store(self, frame, rsp_len, response, start):
+        """ Keep a response of a request sent at start, for requests answered another way, like batches. """
+        with self.lock:
+            self.cache[self.key(frame, rsp_len)] = (start, response)
+
+    def run(self, frame, rsp_len, fetch, freshness_s=None):
+        """ Return fetch(), shared with identical read-only requests in flight or answered recently.
+
+        freshness_s overrides the registered window, for callers that know a
+        request is read-only without registering it.
+        """
+        key = self.key(frame, rsp_len)
+        if freshness_s is None:
+            freshness_s = self.read_only.get(key)
+        if freshness_s is None:
+            response = fetch()
+            self.invalidate()
+            return response
+
+        response = self.lookup(frame, rsp_len, freshness_s)
+        if response is not None:
+            return response
+        with self.lock:
+            flight = self.in_flight.get(key)
+            leader = flight is None
+            if leader:
+                flight = self.in_flight[key] = Flight()
+
+        if not leader:
+            flight.done.wait()
+            self.shared += 1
+            if flight.error:
+                raise flight.error
+            return flight.response
+
+        # The response is as old as the request, it may reflect the pack any time after this
+        start = time.monotonic()
+        try:
+            flight.response = fetch()
+            if freshness_s > 0:
+                self.store(frame, rsp_len, flight.response, start)
+            return flight.response
+        except Exception as e:
+            flight.error = e
+            raise
+        finally:
+            with self.lock:
+                del self.in_flight[key]
+            flight.done.set()
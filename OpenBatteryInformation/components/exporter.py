@@ -0,0 +1,151 @@
+""" Streaming export of pack snapshots and telemetry to CSV or Parquet files.
+
+Records are queued by the acquisition path and written in batches by a
+background thread, so a slow disk never stalls a read or a stream. The queue
+is bounded: when the writer falls behind, new records are dropped and
+counted instead of growing memory without limit.
+
+Columns are fixed when the exporter is opened, as a dict of name to type
+(float, int or str). Missing values are written as empty cells, or nulls in
+Parquet. Parquet support needs pyarrow, which is only imported when a
+Parquet file is opened.
+"""
+
+import csv
+import os
+import queue
+import threading
+import time
+
+QUEUE_SIZE = 10000
+BATCH_SIZE = 1000
+FLUSH_INTERVAL_S = 1.0
+
+
+class Exporter:
+    def __init__(self, path, columns, queue_size=QUEUE_SIZE, batch_size=BATCH_SIZE, flush_interval=FLUSH_INTERVAL_S):
+        self.path = path
+        self.columns = dict(columns)
+        self.batch_size = batch_size
+        self.flush_interval = flush_interval
+        self.queue = queue.Queue(queue_size)
+        self.written = 0
+        self.dropped = 0
+        self.error = None
+        self.closing = threading.Event()
+        self.open()
+        self.writer = threading.Thread(target=self.run, daemon=True)
+        self.writer.start()
+
+    def write(self, record):
+        """ Queue one record, a dict of column values. Never blocks, returns False if it was dropped. """
+        if self.closing.is_set():
+            return False
+        try:
+            self.queue.put_nowait(record)
+            return True
+        except queue.Full:
+            self.dropped += 1
+            return False
+
+    def close(self):
+        """ Write what is still queued and close the file. """
+        self.closing.set()
+        self.writer.join()
+        if self.error:
+            raise self.error
+
+    def run(self):
+        try:
+            while True:
+                batch = self.take_batch()
+                if batch:
+                    self.write_batch([self.row(record) for record in batch])
+                    self.written += len(batch)
+                elif self.closing.is_set() and self.queue.empty():
+                    break
+        except Exception as e:
+            self.error = e
+        finally:
+            self.close_file()
+
+    def take_batch(self):
+        """ Wait for up to batch_size records, or for the flush interval to pass. """
+        batch = []
+        deadline = time.monotonic() + self.flush_interval
+        while len(batch) < self.batch_size:
+            timeout = deadline - time.monotonic()
+            if timeout <= 0 or (self.closing.is_set() and self.queue.empty()):
+                break
+            try:
+                batch.append(self.queue.get(timeout=min(timeout, 0.1)))
+            except queue.Empty:
+                pass
+        return batch
+
+    def row(self, record):
+        row = []
+        for name, kind in self.columns.items():
+            value = record.get(name)
+            try:
+                row.append(None if value is None or value == "" else kind(value))
+            except (TypeError, ValueError):
+                row.append(None)
+        return row
+
+    def open(self):
+        raise NotImplementedError
+
+    def write_batch(self, rows):
+        raise NotImplementedError
+
+    def close_file(self):
+        raise NotImplementedError
+
+
+class CsvExporter(Exporter):
+    def open(self):
+        self.file = open(self.path, 'w', newline='')
+        self.csv = csv.writer(self.file)
+        self.csv.writerow(list(self.columns))
+
+    def write_batch(self, rows):
+        self.csv.writerows(["" if value is None else value for value in row] for row in rows)
+        self.file.flush()
+
+    def close_file(self):
+        self.file.close()
+
+
+class ParquetExporter(Exporter):
+    TYPES = {float: 'float64', int: 'int64', str: 'string'}
+
+    def open(self):
+        try:
+            import pyarrow
+            import pyarrow.parquet
+        except ImportError:
+            raise ImportError("Parquet export needs pyarrow (pip install pyarrow)")
+        self.pyarrow = pyarrow
+        self.schema = pyarrow.schema([(name, self.TYPES[kind]) for name, kind in self.columns.items()])
+        self.parquet = pyarrow.parquet.ParquetWriter(self.path, self.schema)
+
+    def write_batch(self, rows):
+        # One row group per batch, columns are built from the rows
+        names = list(self.columns)
+        arrays = {name: [row[i] for row in rows] for i, name in enumerate(names)}
+        self.parquet.write_table(self.pyarrow.Table.from_pydict(arrays, schema=self.schema))
+
+    def close_file(self):
+        self.parquet.close()
+
+
+FORMATS = {'.csv': CsvExporter, '.parquet': ParquetExporter}
+
+
+def open_exporter(path, columns, **kwargs):
+    """ An exporter for the format given by the file extension. """
+    extension = os.path.splitext(path)[1].lower()
+    if extension not in FORMATS:
+        raise ValueError(f"Unknown export format '{extension}'")
+    return FORMATS[extension](path, columns, **kwargs)
@@ -0,0 +1,482 @@
+""" Multiplexer daemon: one process owns an ArduinoOBI port and shares it over a Unix socket.
+
+Only one process can open a serial port. The daemon opens it and lets the
+GUI, loggers and scripts use it at the same time through the "OBI Mux"
+interface:
+
+    python -m components.mux_server /dev/ttyUSB0
+
+Clients send JSON lines {"id", "op", "priority", ...} and get {"id",
+"result"} or {"id", "error"} back. Requests wait in one priority queue, lower
+priority values first, so interactive requests overtake background polling.
+Plain 0x33/0xCC requests that are queued together are sent as one BATCH
+transaction and one power-up. Requests a client marks read-only share one
+transaction with identical ones and are answered from recent responses
+within their freshness window. A device stream is shared: every subscriber
+gets each update as {"event": "stream", "values", "changed", "time"}.
+
+A sequence of requests that must each reach the device, like bus timing
+tuning, starts with {"op": "exclusive_begin", "token"} and ends with
+{"op": "exclusive_end"}. In between the daemon only runs requests that carry
+"exclusive": token, other requests wait until the sequence ends or its
+client disconnects.
+"""
+
+import argparse
+import glob
+import itertools
+import json
+import os
+import queue
+import socket
+import stat
+import tempfile
+import threading
+import time
+from components import obi_device
+
+
+PRIORITY_INTERACTIVE = 0
+PRIORITY_BACKGROUND = 10
+
+# How long the device worker waits for more requests to join a batch
+BATCH_WAIT_S = 0.005
+# Messages queued per client before its stream updates are dropped
+CLIENT_QUEUE_SIZE = 256
+# Frames the device stream may send ahead of the fan out
+STREAM_WINDOW = 16
+
+
+def socket_dir():
+    """ Per user: anyone who can connect can send any command to the pack. """
+    runtime_dir = os.environ.get('XDG_RUNTIME_DIR')
+    if runtime_dir:
+        return os.path.join(runtime_dir, 'obi')
+    return os.path.join(tempfile.gettempdir(), f'obi-{os.getuid()}')
+
+
+def private_dir(directory):
+    """ True if directory is ours and closed to everyone else, so nobody else can connect or plant a socket. """
+    try:
+        st = os.lstat(directory)
+    except FileNotFoundError:
+        return False
+    return stat.S_ISDIR(st.st_mode) and st.st_uid == os.getuid() and not st.st_mode & 0o077
+
+
+def make_socket_dir(directory):
+    os.makedirs(directory, mode=0o700, exist_ok=True)
+    if not private_dir(directory):
+        raise RuntimeError(f"{directory} must be a directory only this user can access")
+
+
+def socket_path(port):
+    return os.path.join(socket_dir(), os.path.basename(port) + '.sock')
+
+
+def list_sockets():
+    directory = socket_dir()
+    if not private_dir(directory):
+        return []
+    return sorted(glob.glob(os.path.join(directory, '*.sock')))
+
+
+def socket_in_use(path):
+    """ True if a daemon accepts connections on path. A socket file nobody listens on is left from one that died. """
+    probe = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    try:
+        probe.connect(path)
+        return True
+    except (ConnectionRefusedError, FileNotFoundError):
+        return False
+    finally:
+        probe.close()
+
+
+def is_int(value, low=None, high=None):
+    return (isinstance(value, int) and not isinstance(value, bool)
+            and (low is None or value >= low) and (high is None or value <= high))
+
+
+def is_frame(value):
+    return isinstance(value, list) and len(value) >= 4 and all(is_int(byte, 0, 0xFF) for byte in value)
+
+
+def message_error(message):
+    """ Why a client message can't be queued, None if it can. The device thread must never see a malformed one. """
+    if not isinstance(message, dict):
+        return "A message must be an object"
+    if not is_int(message.get('priority', PRIORITY_BACKGROUND)):
+        return "priority must be an integer"
+    if message.get('exclusive') is not None and not is_int(message['exclusive']):
+        return "exclusive must be an integer"
+    op = message.get('op')
+    if op == 'exclusive_begin' and not is_int(message.get('token')):
+        return "exclusive_begin needs an integer token"
+    if op == 'transact':
+        if not is_frame(message.get('frame')) or not is_int(message.get('rsp_len'), 0, 0xFF):
+            return "transact needs a frame of at least 4 bytes and an rsp_len"
+        for key in ('read_only', 'timeout'):
+            value = message.get(key)
+            if value is not None and (isinstance(value, bool) or not isinstance(value, (int, float)) or value < 0):
+                return f"{key} must be a number"
+        if message.get('max_attempts') is not None and not is_int(message['max_attempts'], 1):
+            return "max_attempts must be a positive integer"
+    elif op == 'macro':
+        frames = message.get('frames')
+        if not is_int(message.get('slot'), 0) or not isinstance(frames, list) or not all(map(is_frame, frames)):
+            return "macro needs a slot and a list of frames"
+    elif op == 'stream_start':
+        deadbands = message.get('deadbands')
+        if (not is_frame(message.get('frame')) or not is_int(message.get('interval_ms'), 0, 0xFFFF)
+                or not is_int(message.get('heartbeat_s'), 0, 0xFFFF) or not isinstance(deadbands, dict)
+                or not all(word.isdigit() and int(word) < 16 and is_int(deadband, 0, 0xFF)
+                           for word, deadband in deadbands.items())):
+            return "stream_start needs a frame, interval_ms, heartbeat_s and deadbands"
+    return None
+
+
+class Logger:
+    """ Stands in for the OBI window the interfaces report to. """
+    def __init__(self, verbose=False):
+        self.verbose = verbose
+
+    def update_debug(self, message):
+        if self.verbose or not message.startswith(('>>', '<<')):
+            print(message, flush=True)
+
+
+class Job:
+    def __init__(self, client, message):
+        self.client = client
+        self.id = message.get('id')
+        self.op = message.get('op')
+        self.message = message
+
+    def batchable(self):
+        if self.op != 'transact':
+            return False
+        frame = self.message['frame']
+        return frame[0] == 0x01 and frame[3] in obi_device.BATCHABLE_COMMANDS and self.message['rsp_len'] == frame[2]
+
+    def reply(self, result=None, error=None):
+        if error is not None:
+            self.client.send({'id': self.id, 'error': error})
+        else:
+            self.client.send({'id': self.id, 'result': result})
+
+
+class ClientConnection:
+    def __init__(self, mux, sock):
+        self.mux = mux
+        self.sock = sock
+        self.outgoing = queue.Queue(CLIENT_QUEUE_SIZE)
+        self.dropped = 0
+        self.closed = False
+        threading.Thread(target=self.write_loop, daemon=True).start()
+        threading.Thread(target=self.read_loop, daemon=True).start()
+
+    def send(self, message, drop=False):
+        """ Queue a message. Replies always go out, stream updates are dropped for a client that falls behind. """
+        if self.closed:
+            return
+        if not drop:
+            self.outgoing.put(message)
+            return
+        try:
+            self.outgoing.put_nowait(message)
+        except queue.Full:
+            self.dropped += 1
+
+    def write_loop(self):
+        try:
+            while True:
+                message = self.outgoing.get()
+                if message is None:
+                    break
+                self.sock.sendall(json.dumps(message).encode() + b'\n')
+        except OSError:
+            pass
+        self.close()
+
+    def read_loop(self):
+        try:
+            for line in self.sock.makefile('rb'):
+                try:
+                    message = json.loads(line)
+                except ValueError:
+                    self.send({'error': "Invalid message"})
+                    continue
+                error = message_error(message)
+                if error:
+                    self.send({'id': message.get('id') if isinstance(message, dict) else None, 'error': error})
+                    continue
+                self.mux.submit(Job(self, message))
+        except OSError:
+            pass
+        self.close()
+
+    def close(self):
+        if self.closed:
+            return
+        self.closed = True
+        self.mux.disconnect(self)
+        try:
+            self.outgoing.put_nowait(None)
+        except queue.Full:
+            pass
+        try:
+            self.sock.close()
+        except OSError:
+            pass
+
+
+class Mux:
+    def __init__(self, interface, path, batch=True):
+        self.interface = interface
+        self.path = path
+        self.batch = batch
+        self.pending = queue.PriorityQueue()
+        self.order = itertools.count()
+        self.lock = threading.Lock()
+        self.clients = set()
+        self.subscribers = set()
+        self.stream_request = None
+        # (client, token) of the exclusive sequence holding the device, and the queue entries waiting for it
+        self.owner = None
+        self.deferred = []
+        self.transactions = 0
+        self.requests = 0
+
+    def submit(self, job):
+        if job.op == 'hello':
+            job.reply({'port': self.interface.serial.port, 'version': list(self.interface.firmware_version or ())})
+            return
+        priority = job.message.get('priority', PRIORITY_BACKGROUND)
+        self.pending.put((priority, next(self.order), job))
+
+    def disconnect(self, client):
+        with self.lock:
+            self.clients.discard(client)
+        self.unsubscribe(client)
+        # Ends an exclusive sequence the client left open, in the device thread that owns the state
+        self.pending.put((PRIORITY_INTERACTIVE, next(self.order), Job(client, {'op': 'disconnect'})))
+
+    def may_run(self, job):
+        """ False while another client's, or another thread's, exclusive sequence holds the device. """
+        if self.owner is None or job.op == 'disconnect':
+            return True
+        client, token = self.owner
+        return job.client is client and job.message.get('exclusive') == token
+
+    def release(self):
+        """ End the exclusive sequence, the requests that waited for it keep their place in the queue. """
+        self.owner = None
+        for entry in self.deferred:
+            self.pending.put(entry)
+        self.deferred = []
+
+    def serve_forever(self):
+        directory = os.path.dirname(os.path.abspath(self.path))
+        if directory == socket_dir():
+            make_socket_dir(directory)
+        if os.path.exists(self.path):
+            if socket_in_use(self.path):
+                raise RuntimeError(f"Another multiplexer is serving {self.path}")
+            os.remove(self.path)
+        server = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        # Owner only from the start, also when the socket is placed outside socket_dir()
+        umask = os.umask(0o177)
+        try:
+            server.bind(self.path)
+        finally:
+            os.umask(umask)
+        os.chmod(self.path, 0o600)
+        server.listen()
+        threading.Thread(target=self.device_loop, daemon=True).start()
+        print(f"Serving {self.interface.serial.port} on {self.path}", flush=True)
+        try:
+            while True:
+                sock, _ = server.accept()
+                with self.lock:
+                    self.clients.add(ClientConnection(self, sock))
+        finally:
+            server.close()
+            os.remove(self.path)
+
+    def device_loop(self):
+        while True:
+            entry = self.pending.get()
+            job = entry[2]
+            if not self.may_run(job):
+                self.deferred.append(entry)
+                continue
+            jobs = [job]
+            try:
+                if self.answer_from_cache(job):
+                    continue
+                if self.batch and self.owner is None and job.batchable() and self.interface.supports('batch'):
+                    jobs += self.collect_batch(job)
+                if len(jobs) > 1:
+                    self.run_batch(jobs)
+                else:
+                    self.run(job)
+            except Exception as e:
+                for queued in jobs:
+                    queued.reply(error=str(e))
+
+    def answer_from_cache(self, job):
+        freshness_s = job.message.get('read_only') if job.op == 'transact' else None
+        if freshness_s is None:
+            return False
+        response = self.interface.coalescer.lookup(job.message['frame'], job.message['rsp_len'], freshness_s)
+        if response is None:
+            return False
+        job.reply(list(response))
+        return True
+
+    def collect_batch(self, first):
+        """ Take further queued requests that fit in one BATCH with first. """
+        steps = len(first.message['frame']) - 1
+        rsp_len = first.message['rsp_len']
+        jobs = []
+        skipped = []
+        deadline = time.monotonic() + BATCH_WAIT_S
+        while True:
+            try:
+                entry = self.pending.get(timeout=max(0.0, deadline - time.monotonic()))
+            except queue.Empty:
+                break
+            job = entry[2]
+            if self.answer_from_cache(job):
+                continue
+            frame = job.message.get('frame', ())
+            if (not job.batchable() or steps + len(frame) - 1 > obi_device.BATCH_MAX_STEPS
+                    or rsp_len + job.message['rsp_len'] > obi_device.BATCH_MAX_RSP):
+                skipped.append(entry)
+                continue
+            steps += len(frame) - 1
+            rsp_len += job.message['rsp_len']
+            jobs.append(job)
+        # Skipped requests keep their place in the queue
+        for entry in skipped:
+            self.pending.put(entry)
+        return jobs
+
+    def run_batch(self, jobs):
+        # Identical read-only requests are sent once
+        frames = []
+        index = {}
+        for job in jobs:
+            key = bytes(job.message['frame'])
+            if job.message.get('read_only') is None or key not in index:
+                index[key] = len(frames)
+                frames.append(job.message['frame'])
+            job.step = index[key]
+
+        start = time.monotonic()
+        responses = self.interface.batch(frames)
+        self.transactions += 1
+        self.requests += len(jobs)
+        if any(job.message.get('read_only') is None for job in jobs):
+            self.interface.coalescer.invalidate()
+        for job in jobs:
+            response = responses[job.step]
+            if job.message.get('read_only') and response is not None:
+                self.interface.coalescer.store(job.message['frame'], job.message['rsp_len'], response, start)
+            job.reply(None if response is None else list(response))
+
+    def run(self, job):
+        message = job.message
+        if job.op in ('transact', 'macro'):
+            self.transactions += 1
+            self.requests += 1
+        if job.op == 'transact':
+            args = (message['frame'], message['rsp_len'], message.get('max_attempts'), message.get('timeout'))
+            if message.get('read_only') is not None:
+                response = self.interface.coalescer.run(message['frame'], message['rsp_len'],
+                                                        lambda: self.interface.device_transact(*args),
+                                                        message['read_only'])
+            else:
+                response = self.interface.transact(*args)
+            job.reply(None if response is None else list(response))
+        elif job.op == 'macro':
+            job.reply(list(self.interface.run_macro(message['slot'], message['frames'])))
+        elif job.op == 'stream_start':
+            self.subscribe(job)
+        elif job.op == 'stream_stop':
+            self.unsubscribe(job.client)
+            job.reply()
+        elif job.op == 'exclusive_begin':
+            self.owner = (job.client, message['token'])
+            job.reply()
+        elif job.op == 'exclusive_end':
+            if self.owner is not None:
+                self.release()
+            job.reply()
+        elif job.op == 'disconnect':
+            if self.owner is not None and self.owner[0] is job.client:
+                self.release()
+        elif job.op == 'stats':
+            job.reply({'transactions': self.transactions, 'requests': self.requests,
+                       'cached': self.interface.coalescer.cached,
+                       'clients': len(self.clients), 'subscribers': len(self.subscribers)})
+        else:
+            job.reply(error=f"Unknown operation '{job.op}'")
+
+    def subscribe(self, job):
+        message = job.message
+        request = (tuple(message['frame']), message['interval_ms'], message['heartbeat_s'],
+                   tuple(sorted(message['deadbands'].items())))
+        with self.lock:
+            if self.stream_request is None:
+                deadbands = {int(word): deadband for word, deadband in message['deadbands'].items()}
+                self.interface.start_stream(message['frame'], message['interval_ms'], message['heartbeat_s'],
+                                            deadbands, self.fan_out, STREAM_WINDOW)
+                self.stream_request = request
+            elif self.stream_request != request:
+                job.reply(error="Another client runs a different stream on this interface.")
+                return
+            self.subscribers.add(job.client)
+        job.reply()
+
+    def unsubscribe(self, client):
+        with self.lock:
+            if client not in self.subscribers:
+                return
+            self.subscribers.discard(client)
+            if self.subscribers:
+                return
+            self.stream_request = None
+        self.interface.stop_stream()
+
+    def fan_out(self, values, changed):
+        event = {'event': 'stream', 'values': values, 'changed': changed, 'time': self.interface.stream_time}
+        with self.lock:
+            subscribers = list(self.subscribers)
+        for client in subscribers:
+            client.send(event, drop=True)
+        self.interface.ack_stream()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Share an ArduinoOBI port between several clients.")
+    parser.add_argument('port', help="Serial port of the interface")
+    parser.add_argument('--socket', help="Unix socket path (default: %s)" % socket_path('<port>'))
+    parser.add_argument('--no-batch', action='store_true', help="Send every request on its own")
+    parser.add_argument('--verbose', action='store_true', help="Log every request and response")
+    args = parser.parse_args()
+
+    path = args.socket or socket_path(args.port)
+    # Checked before the port is opened, opening it resets the device under the running daemon
+    if socket_in_use(path):
+        parser.exit(1, f"A multiplexer is already serving {path}\n")
+
+    device = obi_device.ObiDevice(Logger(args.verbose))
+    print(f"Firmware {device.open(args.port)}", flush=True)
+
+    Mux(device, path, not args.no_batch).serve_forever()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,134 @@
+""" Frame encoding, CRC and response decoding for the OBI host.
+
+The compiled extension (components._obi_native, built from native/obi_native.cpp
+with `python setup.py build_ext --inplace`) is used when it is available. The
+pure Python implementations below have the same behaviour, results and exceptions,
+and are used otherwise. tests/test_obi_codec.py runs both on the same inputs.
+"""
+
+from array import array
+
+FRAME_START = 0x01
+
+
+def to_bytes(data):
+    """ data as the native codec reads it: bytes-like objects as they are, other sequences of ints 0..255 copied. """
+    if isinstance(data, (bytes, bytearray)):
+        return data
+    if isinstance(data, int):
+        raise TypeError(f"cannot convert '{type(data).__name__}' object to bytes")
+    return bytes(data)
+
+
+def crc8(data):
+    """ Dallas/Maxim 8 bit CRC, same as OneWire::crc8 in the firmware. """
+    crc = 0
+    for byte in to_bytes(data):
+        crc ^= byte
+        for _ in range(8):
+            if crc & 0x01:
+                crc = (crc >> 1) ^ 0x8C
+            else:
+                crc >>= 1
+    return crc
+
+
+def crc16(data, crc=0):
+    """ Dallas/Maxim 16 bit CRC, same as OneWire::crc16 in the firmware. """
+    for byte in to_bytes(data):
+        crc ^= byte
+        for _ in range(8):
+            if crc & 0x0001:
+                crc = (crc >> 1) ^ 0xA001
+            else:
+                crc >>= 1
+    return crc
+
+
+def rom_id_valid(rom_id):
+    """ True if the last of the 8 ROM ID bytes is the CRC8 of the others and the bus wasn't stuck, as the firmware checks it. """
+    rom_id = bytes(rom_id)
+    return len(rom_id) == 8 and rom_id not in (bytes(8), b'\xff' * 8) and crc8(rom_id[:7]) == rom_id[7]
+
+
+def encode_frame(cmd, payload=b'', rsp_len=0):
+    """ Build a request frame: start, payload length, response length, command, payload. """
+    payload = to_bytes(payload)
+    return bytes([FRAME_START, len(payload), rsp_len, cmd]) + payload
+
+
+def check_response(response, rsp_len):
+    """ True if the response has the expected length and is not an idle bus (all 0xFF). """
+    response = to_bytes(response)
+    if len(response) != rsp_len + 2:
+        return False
+    return rsp_len == 0 or any(byte != 0xFF for byte in response[2:])
+
+
+def decode_u16le(buf, offset, count, divisor=1, out=None):
+    """ Decode `count` little endian uint16 values starting at `offset`, divided by `divisor`.
+
+    When `out` is given (an array('d') or list of at least `count` items) it is
+    filled in place so callers can reuse a preallocated buffer.
+    """
+    buf = to_bytes(buf)
+    if offset < 0 or count < 0 or offset + count * 2 > len(buf):
+        raise ValueError("Buffer too short")
+    if out is None:
+        out = array('d', bytes(count * 8))
+    elif len(out) < count:
+        raise ValueError("Output buffer too short")
+    for i in range(count):
+        pos = offset + i * 2
+        out[i] = (buf[pos] | (buf[pos + 1] << 8)) / divisor
+    return out
+
+
+def nibble_swap(value):
+    """ Swap the nibbles of an int, or of every byte in a bytes-like object. """
+    if isinstance(value, int):
+        return ((value & 0xF0) >> 4) | ((value & 0x0F) << 4)
+    return bytes(((b & 0xF0) >> 4) | ((b & 0x0F) << 4) for b in to_bytes(value))
+
+
+def split_frames(buf):
+    """ Split a stream of response frames (command, length, payload).
+
+    Returns a list of (command, payload) tuples and the number of bytes
+    consumed. Trailing bytes of an incomplete frame are left for the next call.
+    """
+    buf = to_bytes(buf)
+    frames = []
+    pos = 0
+    while pos + 2 <= len(buf):
+        length = buf[pos + 1]
+        if pos + 2 + length > len(buf):
+            break
+        frames.append((buf[pos], bytes(buf[pos + 2:pos + 2 + length])))
+        pos += 2 + length
+    return frames, pos
+
+
+class Macro:
+    """ A constant sequence of request frames, encoded once.
+
+    steps is the sequence laid out like an interface macro slot (each frame
+    without its start byte), crc is the CRC8 of the slot (length byte and
+    steps) and rsp_len the total response length. Define these at module
+    level so the work is done at import, not on every send.
+    """
+    __slots__ = ('frames', 'steps', 'crc', 'rsp_len')
+
+    def __init__(self, frames):
+        self.frames = [bytes(frame) for frame in frames]
+        self.steps = b''.join(frame[1:] for frame in self.frames)
+        self.crc = crc8(bytes([len(self.steps)]) + self.steps)
+        self.rsp_len = sum(frame[2] for frame in self.frames)
+
+
+try:
+    from components._obi_native import (crc8, crc16, encode_frame, check_response,
+                                        decode_u16le, nibble_swap, split_frames)
+    NATIVE = True
+except ImportError:
+    NATIVE = False
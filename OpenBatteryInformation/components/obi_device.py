@@ -0,0 +1,760 @@
+""" An ArduinoOBI on a serial port: the protocol and connection state, without widgets.
+
+The "Arduino OBI" interface shows it in the GUI and the multiplexer daemon
+runs it headless. obi_instance only needs update_debug(message).
+"""
+
+import contextlib
+import threading
+import queue
+import time
+import struct
+import serial
+from components import obi_codec
+from components import retry_policy
+from components import coalescer
+from components import clock_sync
+
+INTERFACE_VERSION_CMD   = [0x01, 0x00, 0x03, 0x01]
+DEVICE_TIME_CMD         = [0x01, 0x00, 0x08, 0x0A]
+MACRO_INFO_CMD          = [0x01, 0x00, 0x08, 0x11]
+MACRO_BUILTIN_CMD       = [0x01, 0x00, 0x11, 0x13]
+JOB_STOP_CMD            = [0x01, 0x00, 0x00, 0x21]
+JOB_STATUS_CMD          = [0x01, 0x00, 0x11, 0x22]
+STREAM_STOP_CMD         = [0x01, 0x00, 0x00, 0x51]
+
+MACRO_INVOKE_START      = 0x02
+SNAPSHOT                = 0x08
+SNAPSHOT_HEADER         = 9
+MACRO_STORE             = 0x10
+BATCH                   = 0x12
+# Batch limits: request data length byte, and the firmware keeps room for 0x33 ROM bytes in its response buffer
+BATCH_MAX_STEPS         = 255
+BATCH_MAX_RSP           = 245
+# Bus commands the firmware BATCH runs
+BATCHABLE_COMMANDS      = (0x33, 0xCC)
+MACRO_SLOTS             = 8
+MACRO_SLOT_SIZE         = 64
+BUILTIN_MACRO_BASE      = 0x80
+JOB_START               = 0x20
+JOB_READ_LOG            = 0x23
+JOB_SEQ_EMPTY           = 0xFFFF
+CAPTURE                 = 0x40
+CAPTURE_MAX_RSP         = 253
+# Largest step response the firmware keeps for jobs, captures and streams
+STEP_MAX_RSP            = 32
+STREAM_START            = 0x50
+STREAM_FRAME            = 0x52
+STREAM_CREDIT           = 0x53
+FIELD_READ              = 0x60
+TIMING_MARGINS          = 0x70
+# The firmware samples read slots this long after releasing the line
+SAMPLE_POINT_US         = 10
+PRESENCE_TIMING         = 0x71
+RESET_TIMING            = 0x72
+
+# Reset low times tried when tuning, the firmware default is the longest
+RESET_LOW_CANDIDATES    = (480, 520, 560, 600, 650, 700, 750)
+RESET_LOW_MARGIN_US     = 50
+RESET_DEFAULT_RECOVERY  = 410
+RESET_RECOVERY_MARGIN   = 40
+# The firmware samples the presence pulse this long after releasing the line
+PRESENCE_SAMPLE_US      = 70
+# Byte gaps tried when tuning, longest first, all shorter than the firmware default of 90 us
+BYTE_GAP_CANDIDATES     = (75, 60, 45, 30)
+BYTE_GAP_MARGIN_US      = 15
+BYTE_GAP_DEFAULT        = 90
+
+# Why a capture stopped, first byte of its response
+CAPTURE_REASONS = {
+    0: 'timeout',
+    1: 'cell voltage low',
+    2: 'cell voltage high',
+    3: 'temperature high',
+    4: 'cell spread',
+}
+
+# First firmware version with each optional feature
+FEATURE_VERSIONS = {
+    'macros': (0, 3, 0),
+    'jobs': (0, 4, 0),
+    'capture': (0, 5, 0),
+    'stream': (0, 6, 0),
+    'field_read': (0, 7, 0),
+    'timing_margins': (0, 8, 0),
+    'reset_timing': (0, 9, 0),
+    'builtin_macros': (0, 10, 0),
+    'snapshot': (0, 12, 0),
+    'stream_credits': (0, 13, 0),
+    'batch': (0, 14, 0),
+    'device_time': (0, 15, 0),
+    'byte_gap': (0, 16, 0),
+}
+
+# Attempts per request until the retry policy has seen enough of a command
+DEFAULT_ATTEMPTS        = 2
+
+
+class RequestRejected(Exception):
+    """ The device answered, but with no data: it won't run the command with these parameters. """
+
+
+class ObiDevice:
+    def __init__(self, obi_instance):
+        self.obi_instance = obi_instance
+        self.serial = serial.Serial()
+        self.serial.timeout = 1
+        # Requests may come from the GUI and from "Read all packs" worker threads
+        self.lock = threading.RLock()
+        # Depth of exclusive() sequences held by the current thread
+        self.local = threading.local()
+        self.retry_policy = retry_policy.shared()
+        self.firmware_version = None
+        # CRC8 of each EEPROM macro slot, read once per connection
+        self.macro_crcs = None
+        # CRC8 of each built-in flash macro, read once per connection
+        self.builtin_crcs = None
+        # While a stream runs a reader thread owns the port and passes responses on through this queue
+        self.stream_reader = None
+        self.stream_callback = None
+        self.stream_values = {}
+        self.responses = queue.Queue()
+        # Frames a credit limited stream may send ahead of the host, 0 without flow control
+        self.stream_window = 0
+        self.stream_acked = 0
+        # Acks come from the stream reader thread and the consumer's, the counter must not lose or repeat credits
+        self.stream_lock = threading.Lock()
+        # Credit grants are written from the consumer's thread while a request may be in flight
+        self.write_lock = threading.Lock()
+        # What holds the device for a long time, like a capture, so other threads fail fast instead of waiting
+        self.busy = None
+        # Identical read-only requests from several threads share one transaction
+        self.coalescer = coalescer.RequestCoalescer()
+        # Reading the clock changes nothing, it must not clear the coalescer's cache. Never reused, a stale time is useless.
+        self.coalescer.register(DEVICE_TIME_CMD)
+        # Offset and drift of the device clock, sampled while a stream runs
+        self.clock_sync = clock_sync.ClockSync(self)
+        # Wall-clock time of the sample in the latest stream frame, None if the firmware doesn't stamp them
+        self.stream_time = None
+
+    def open(self, port):
+        """ Open the serial port, which resets the device, and return its firmware version. """
+        self.serial.port = port
+        self.retry_policy.release(port)
+        self.firmware_version = None
+        self.macro_crcs = None
+        self.builtin_crcs = None
+        # Opening the port resets the device and its clock
+        self.clock_sync.stop()
+        self.clock_sync = clock_sync.ClockSync(self)
+        try:
+            self.serial.open()
+            return self.get_version()
+        except Exception:
+            self.serial.close()
+            raise
+
+    def close(self):
+        """ Close the serial port, returns whether it was open. """
+        self.stream_reader = None
+        self.clock_sync.stop()
+        if not self.serial.is_open:
+            return False
+        self.serial.close()
+        return True
+
+    def get_version(self):
+        response = self.request(INTERFACE_VERSION_CMD, max_attempts=5)
+        self.firmware_version = tuple(response[2:5])
+        version_string = '.'.join(str(byte) for byte in response[2:])
+    
+        return version_string
+    
+    def device_time(self):
+        """ The device clock in us, 64 bits so it doesn't wrap. """
+        response = self.request(DEVICE_TIME_CMD)
+        return int.from_bytes(response[2:10], 'little')
+
+    def supports(self, feature):
+        """ True if the connected firmware has the optional feature. """
+        return self.firmware_version is not None and self.firmware_version >= FEATURE_VERSIONS[feature]
+
+    def run_macro(self, slot, macro):
+        """ Run an obi_codec.Macro (or a list of request frames) as one transaction in a single powered session.
+
+        Macros the firmware has built in run from flash. Others are stored in
+        the EEPROM macro slot the first time, after that only the 2 byte invoke
+        frame is sent. Returns the concatenated responses of all frames.
+        """
+        if not isinstance(macro, obi_codec.Macro):
+            macro = obi_codec.Macro(macro)
+        steps = macro.steps
+        # The slot also keeps the steps length and their CRC8
+        if slot >= MACRO_SLOTS or len(steps) + 2 > MACRO_SLOT_SIZE:
+            raise ValueError(f"Macro does not fit in slot {slot}")
+        expected_crc = macro.crc
+
+        with self.exclusive():
+            if self.supports('builtin_macros'):
+                if self.builtin_crcs is None:
+                    response = self.request(MACRO_BUILTIN_CMD)
+                    self.builtin_crcs = list(response[3:3 + response[2]])
+                if expected_crc in self.builtin_crcs:
+                    builtin_slot = BUILTIN_MACRO_BASE + self.builtin_crcs.index(expected_crc)
+                    return self.transact(bytes([MACRO_INVOKE_START, builtin_slot]), macro.rsp_len)
+
+            if self.macro_crcs is None:
+                self.macro_crcs = list(self.request(MACRO_INFO_CMD)[2:])
+
+            if self.macro_crcs[slot] != expected_crc:
+                store_cmd = obi_codec.encode_frame(MACRO_STORE, bytes([slot]) + steps, 1)
+                stored_crc = self.request(store_cmd)[2]
+                if stored_crc != expected_crc:
+                    self.macro_crcs = None
+                    raise Exception(f"Macro slot {slot} failed to verify after storing.")
+                self.macro_crcs[slot] = stored_crc
+                self.obi_instance.update_debug(f"Stored macro in slot {slot}")
+
+            return self.transact(bytes([MACRO_INVOKE_START, slot]), macro.rsp_len)
+
+    def batch(self, frames):
+        """ Run several 0x33/0xCC request frames as one transaction in a single powered session.
+
+        Returns the response of each frame, as request() would. Each response
+        is checked like a single request's, a step that failed on the bus is
+        sent again on its own.
+        """
+        steps = b''.join(bytes(frame[1:]) for frame in frames)
+        rsp_len = sum(frame[2] for frame in frames)
+        if len(steps) > BATCH_MAX_STEPS or rsp_len > BATCH_MAX_RSP:
+            raise ValueError("Batch does not fit in one transaction")
+
+        response = self.transact(obi_codec.encode_frame(BATCH, steps, rsp_len), rsp_len) or b''
+        responses = []
+        pos = 2
+        for frame in frames:
+            if frame[2] == 0:
+                responses.append(None)
+                continue
+            step_response = bytes([frame[3], frame[2]]) + response[pos:pos + frame[2]]
+            pos += frame[2]
+            if not obi_codec.check_response(step_response, frame[2]):
+                self.obi_instance.update_debug(f"Batch step {frame[3]:02X} failed, sending it again")
+                step_response = self.request(frame)
+            responses.append(step_response)
+        return responses
+
+    def start_job(self, frame, interval_s, field_mask, average=1):
+        """ Let the device run frame every interval_s seconds on its own timer.
+
+        The 16 bit response words selected by field_mask are averaged over
+        `average` runs and logged in the device EEPROM. Returns the number of
+        records the log holds before it wraps.
+        """
+        # The device rejects these too, a 0 interval would power cycle the pack and log on every loop
+        if not 0 < interval_s <= 0xFFFF:
+            raise ValueError("The job interval must be 1 to 65535 s")
+        if not 0 < average <= 0xFF:
+            raise ValueError("A job must average 1 to 255 runs")
+        data = struct.pack('<HBHI', interval_s, average, field_mask, int(time.time())) + bytes(frame[1:])
+        capacity = self.request(obi_codec.encode_frame(JOB_START, data, 1))[2]
+        if capacity == 0:
+            raise Exception("The interface rejected the job.")
+        return capacity
+
+    def stop_job(self):
+        self.request(JOB_STOP_CMD)
+
+    def job_status(self):
+        response = self.request(JOB_STATUS_CMD)
+        (active, boot, next_seq, age_ms, interval_s, average,
+         record_size, capacity, epoch) = struct.unpack('<BBHIHBBBI', response[2:19])
+        return {
+            'active': bool(active),
+            'boot': boot,
+            'next_seq': next_seq,
+            'age': None if age_ms == 0xFFFFFFFF else age_ms / 1000,
+            'interval': interval_s,
+            'average': average,
+            'record_size': record_size,
+            'capacity': capacity,
+            'epoch': epoch,
+        }
+
+    def read_job_log(self, from_seq=0):
+        """ Read the logged job records with seq >= from_seq.
+
+        Each record is a dict with seq, boot, fields and time. Times of records
+        from the boot the job was started in are derived from the start time,
+        records from the current boot from the age of the newest record, both
+        on the device's clock. Records from boots in between get time None.
+        """
+        status = self.job_status()
+        record_size = status['record_size']
+        period = status['interval'] * status['average']
+        # Timestamp each record at the middle of its averaging window
+        window_center = (status['average'] - 1) / 2 * status['interval']
+        now = time.time()
+
+        records = []
+        seq = max(from_seq, status['next_seq'] - status['capacity'], 0)
+        while seq < status['next_seq']:
+            count = min(250 // record_size, status['next_seq'] - seq)
+            rsp_len = count * record_size
+            response = self.transact(obi_codec.encode_frame(JOB_READ_LOG, struct.pack('<HB', seq, count), rsp_len), rsp_len)
+
+            for i in range(count):
+                record = response[2 + i * record_size:2 + (i + 1) * record_size]
+                record_seq, boot = struct.unpack('<HB', record[:3])
+                if record_seq == JOB_SEQ_EMPTY:
+                    continue
+
+                if boot == 0:
+                    record_time = status['epoch'] + record_seq * period + window_center
+                elif boot == status['boot'] and status['age'] is not None:
+                    last_logged = now - status['age'] - window_center
+                    record_time = last_logged - (status['next_seq'] - 1 - record_seq) * period
+                else:
+                    record_time = None
+
+                fields = list(struct.unpack(f'<{(record_size - 3) // 2}H', record[3:]))
+                records.append({'seq': record_seq, 'boot': boot, 'time': record_time, 'fields': fields})
+            seq += count
+        return records
+
+    def capture(self, frame, first_cell, cells, temp_word, pre, post, cell_min=0, cell_max=0,
+                temp_max=0, spread_max=0, timeout_s=60):
+        """ Sample frame back to back on the device until a threshold is crossed.
+
+        The words first_cell.. hold the cell voltages and temp_word the
+        temperature, in the raw units of the response. The device keeps the
+        last `pre` samples in a ring and takes `post` more once triggered.
+        Thresholds of 0 are disabled. Returns the trigger reason, the index of
+        the trigger sample and the samples as dicts with the time in seconds
+        relative to the trigger, the raw cell words and the raw temperature.
+        """
+        # The same checks as the firmware's, which rejects a capture only after the host has sent it
+        sample_size = 2 * cells + 4
+        rsp_len = 4 + (pre + post) * sample_size
+        if rsp_len > CAPTURE_MAX_RSP:
+            raise ValueError(f"At most {(CAPTURE_MAX_RSP - 4) // sample_size} samples fit in a capture")
+        if not 0 < timeout_s <= 0xFFFF:
+            raise ValueError("The capture timeout must be 1 to 65535 s")
+        if not 0 < post <= 0xFF or not 0 <= pre <= 0xFF:
+            raise ValueError("A capture takes 0 to 255 samples before and 1 to 255 after the trigger")
+        if len(frame) != frame[1] + 4 or frame[2] > STEP_MAX_RSP:
+            raise ValueError(f"The capture frame must be complete and read at most {STEP_MAX_RSP} bytes")
+        if (first_cell + cells) * 2 > frame[2] or (temp_word + 1) * 2 > frame[2]:
+            raise ValueError("The cell and temperature words must be inside the frame's response")
+
+        data = struct.pack('<BBBBBHHHHH', pre, post, first_cell, cells, temp_word,
+                           cell_min, cell_max, temp_max, spread_max, timeout_s) + bytes(frame[1:])
+        # The device takes no other request until the capture ends, other threads get an error instead of waiting
+        with self.exclusive():
+            self.busy = "capture"
+            try:
+                # Back to back reads take up to ~30 ms each on top of the trigger wait
+                response = self.transact(obi_codec.encode_frame(CAPTURE, data, rsp_len), rsp_len,
+                                         max_attempts=1, timeout=timeout_s + 0.03 * (pre + post) + 1)
+            except RequestRejected:
+                raise Exception("The interface rejected the capture.")
+            finally:
+                self.busy = None
+        reason, n_pre, n_post, size = response[2:6]
+        if size != sample_size:
+            raise Exception("The interface rejected the capture.")
+
+        samples = []
+        for i in range(n_pre + n_post):
+            sample = response[6 + i * size:6 + (i + 1) * size]
+            words = struct.unpack(f'<{cells + 2}H', sample)
+            samples.append({'cells': list(words[:cells]), 'temp': words[cells], 'ms': words[cells + 1]})
+
+        # Sample times are the low 16 bits of the device's millis(), unwrap them around the trigger
+        if samples:
+            ref = samples[min(n_pre, len(samples) - 1)]['ms']
+            for sample in samples:
+                delta = (sample.pop('ms') - ref) & 0xFFFF
+                if delta >= 0x8000:
+                    delta -= 0x10000
+                sample['time'] = delta / 1000
+
+        return {'reason': CAPTURE_REASONS.get(reason, reason), 'trigger': n_pre if n_post else None,
+                'samples': samples}
+
+    def read_fields(self, frame, field_mask):
+        """ Run frame, but only return the 16 bit response words selected by field_mask.
+
+        The device stops reading the bus after the last selected word, so the
+        response is packed: 0x60, length, then the selected words in order.
+        """
+        return self.request(self.field_read_frame(frame, field_mask))
+
+    @staticmethod
+    def field_read_frame(frame, field_mask):
+        """ The FIELD_READ request read_fields() sends, for registering it with the coalescer. """
+        rsp_len = 2 * bin(field_mask).count('1')
+        data = struct.pack('<H', field_mask) + bytes(frame[1:])
+        return obi_codec.encode_frame(FIELD_READ, data, rsp_len)
+
+    def read_snapshot(self, frame, max_age=None):
+        """ The response of frame from the latest run of a device job or stream.
+
+        Answered from the device's RAM without powering the pack. Returns None
+        when no job or stream runs frame, or its latest run is older than
+        max_age seconds.
+        """
+        rsp_len = frame[2]
+        snapshot_cmd = obi_codec.encode_frame(SNAPSHOT, b'', SNAPSHOT_HEADER + rsp_len)
+        # Answered from RAM, it must not clear the coalescer's cache. Never reused, the age is part of the answer.
+        self.coalescer.register(snapshot_cmd)
+        response = self.request(snapshot_cmd)
+        source, step_crc, seq, age_ms, length = struct.unpack('<BBHIB', response[2:2 + SNAPSHOT_HEADER])
+        if source == 0 or step_crc != obi_codec.crc8(bytes(frame[1:])) or length < rsp_len:
+            return None
+        if max_age is not None and age_ms / 1000 > max_age:
+            return None
+        return bytes([frame[3], rsp_len]) + response[2 + SNAPSHOT_HEADER:2 + SNAPSHOT_HEADER + rsp_len]
+
+    def timing_margins(self, frame):
+        """ Run frame with timed read slots and return its response data and the timing margin of every byte read.
+
+        The margin of a byte is how far, in us, its slowest 1 bit rose before the
+        sample point and its earliest 0 bit was released after it, None when
+        the byte has no such bits. For 0x33 frames the ROM ID bytes come first.
+        """
+        bus_len = frame[2] + (8 if frame[3] == 0x33 else 0)
+        rsp_len = 3 * bus_len
+        response = self.request(obi_codec.encode_frame(TIMING_MARGINS, bytes(frame[1:]), rsp_len))
+
+        margins = []
+        timing = response[2 + bus_len:]
+        for i in range(bus_len):
+            rise, release = timing[2 * i], timing[2 * i + 1]
+            margins.append((None if rise == 0xFF else SAMPLE_POINT_US - rise / 4,
+                            None if release == 0xFF else release / 4 - SAMPLE_POINT_US))
+        return {
+            'data': bytes(response[2:2 + bus_len]),
+            'margins': margins,
+            'one_margin': min((m[0] for m in margins if m[0] is not None), default=None),
+            'zero_margin': min((m[1] for m in margins if m[1] is not None), default=None),
+        }
+
+    def measure_presence(self, low_us=None):
+        """ Reset the bus and time the presence pulse, optionally with a different reset low time.
+
+        Returns whether a pack answered and when its presence pulse started
+        after the line was released and how long it lasted, in us.
+        """
+        data = struct.pack('<H', low_us) if low_us else b''
+        response = self.request(obi_codec.encode_frame(PRESENCE_TIMING, data, 5))
+        present, start, length = struct.unpack('<BHH', response[2:7])
+        return {'present': bool(present), 'start': start, 'length': length}
+
+    def set_reset_timing(self, low_us=0, recovery_us=0, byte_gap_us=0):
+        """ Set the bus reset low and recovery times and the gap before each bus byte in us, 0 for the firmware defaults.
+
+        Firmware without 'byte_gap' ignores the gap.
+        """
+        self.request(obi_codec.encode_frame(RESET_TIMING, struct.pack('<HHH', low_us, recovery_us, byte_gap_us)))
+
+    def tune_reset_timing(self, frame, tries=3):
+        """ Find the shortest reset timing the pack reliably answers to.
+
+        The reset low time is the shortest candidate that gets a presence pulse
+        on every try, plus a margin. The recovery time covers the longest
+        presence pulse seen, plus a margin. The result is checked by running
+        frame, which must return static data, on the pack with both the default
+        and the tuned timing. With firmware that has 'byte_gap' the gap before
+        each bus byte is tuned the same way, 0 keeps the firmware default. The
+        tuned timing is left set. Returns (low_us, recovery_us, byte_gap_us).
+        """
+        # Every check must reach the pack, a coalesced or cached response would pass any timing
+        with self.exclusive():
+            return self.locked_tune_reset_timing(frame, tries)
+
+    def locked_tune_reset_timing(self, frame, tries):
+        self.set_reset_timing()
+        reference = self.request(frame)
+
+        low_us = None
+        pulses = []
+        for candidate in RESET_LOW_CANDIDATES:
+            pulses = [self.measure_presence(candidate) for _ in range(tries)]
+            if all(pulse['present'] for pulse in pulses):
+                low_us = min(candidate + RESET_LOW_MARGIN_US, RESET_LOW_CANDIDATES[-1])
+                break
+        if low_us is None:
+            raise Exception("The pack gave no reliable presence pulse.")
+
+        pulse_end = max(pulse['start'] + pulse['length'] for pulse in pulses)
+        recovery_us = max(pulse_end - PRESENCE_SAMPLE_US, 0) + RESET_RECOVERY_MARGIN
+        recovery_us = min(recovery_us, RESET_DEFAULT_RECOVERY)
+
+        self.set_reset_timing(low_us, recovery_us)
+        try:
+            for _ in range(tries):
+                if self.request(frame) != reference:
+                    raise Exception("The pack answered differently with the tuned timing.")
+        except Exception:
+            self.set_reset_timing()
+            raise
+
+        byte_gap_us = 0
+        if self.supports('byte_gap'):
+            byte_gap_us = self.tune_byte_gap(frame, reference, low_us, recovery_us, tries)
+        return low_us, recovery_us, byte_gap_us
+
+    def tune_byte_gap(self, frame, reference, low_us, recovery_us, tries):
+        """ The shortest byte gap that still gets reference for frame on every try, plus a margin, 0 for the default.
+
+        Candidates are tried from the longest down and the search stops at the
+        first one that fails, so a pack that needs the default gap costs one
+        failed request, not one per candidate.
+        """
+        shortest = None
+        for candidate in BYTE_GAP_CANDIDATES:
+            self.set_reset_timing(low_us, recovery_us, candidate)
+            try:
+                if all(self.request(frame) == reference for _ in range(tries)):
+                    shortest = candidate
+                    continue
+            except Exception:
+                pass
+            break
+
+        byte_gap_us = 0 if shortest is None else shortest + BYTE_GAP_MARGIN_US
+        if byte_gap_us >= BYTE_GAP_DEFAULT:
+            byte_gap_us = 0
+        self.set_reset_timing(low_us, recovery_us, byte_gap_us)
+        return byte_gap_us
+
+    def start_stream(self, frame, interval_ms, heartbeat_s, deadbands, callback, window=0):
+        """ Let the device run frame every interval_ms and report changed fields only.
+
+        deadbands maps response word index to the change, in raw units, a word
+        must exceed before it is sent again. All words are sent at least every
+        heartbeat_s. callback(values, changed) is called from a reader thread
+        with the latest value of every word and the set of words that changed.
+
+        With a window the device sends at most that many frames ahead of the
+        consumer, which calls ack_stream() for every update it has handled.
+        A consumer that falls behind then gets fewer, merged updates instead
+        of overflowing the serial buffers.
+
+        Firmware with device time stamps every sample. While the stream runs
+        the device clock is synced, and stream_time holds the wall-clock time
+        of the sample behind the current callback.
+        """
+        field_mask = 0
+        for word in deadbands:
+            field_mask |= 1 << word
+        data = struct.pack('<HHH', interval_ms, heartbeat_s, field_mask)
+        data += bytes(deadbands[word] for word in sorted(deadbands)) + bytes(frame[1:])
+
+        with self.exclusive():
+            if self.stream_reader:
+                raise Exception("A stream is already running.")
+            if self.request(obi_codec.encode_frame(STREAM_START, data, 1))[2] == 0:
+                raise Exception("The interface rejected the stream.")
+            self.stream_callback = callback
+            self.stream_values = {}
+            self.stream_time = None
+            with self.stream_lock:
+                self.stream_window = window if window and self.supports('stream_credits') else 0
+                self.stream_acked = 0
+            if self.stream_window:
+                self.grant_stream(self.stream_window)
+            self.stream_reader = threading.Thread(target=self.read_stream, daemon=True)
+            self.stream_reader.start()
+            if self.supports('device_time'):
+                self.clock_sync.start()
+
+    def ack_stream(self, count=1):
+        """ Tell a credit limited stream that count updates were handled. Safe to call from any thread. """
+        with self.stream_lock:
+            if not self.stream_window or not self.stream_reader:
+                return
+            self.stream_acked += count
+            # Return credits in batches, half a window keeps the device from running dry
+            if self.stream_acked < max(1, self.stream_window // 2):
+                return
+            credits, self.stream_acked = self.stream_acked, 0
+        self.grant_stream(credits)
+
+    def grant_stream(self, credits):
+        # Grants have no response, so they can go out while a request waits for its own
+        with self.write_lock:
+            self.serial.write(obi_codec.encode_frame(STREAM_CREDIT, struct.pack('<H', credits), 0))
+
+    def stop_stream(self):
+        with self.exclusive():
+            if not self.stream_reader:
+                return
+            self.clock_sync.stop()
+            try:
+                self.request(STREAM_STOP_CMD)
+            finally:
+                reader, self.stream_reader = self.stream_reader, None
+                with self.stream_lock:
+                    self.stream_window = 0
+                # Wait for the reader's pending read so it can't take bytes meant for the next request
+                reader.join(timeout=self.serial.timeout + 1)
+
+    def read_stream(self):
+        """ Reader thread: split incoming frames into stream updates and command responses. """
+        buf = b''
+        timed = self.supports('device_time')
+        while self.stream_reader is threading.current_thread() and self.serial.is_open:
+            try:
+                buf += self.serial.read(max(1, self.serial.in_waiting))
+            except Exception as e:
+                self.obi_instance.update_debug(f"Stream stopped: {e}")
+                break
+            frames, consumed = obi_codec.split_frames(buf)
+            buf = buf[consumed:]
+            for cmd, payload in frames:
+                if cmd != STREAM_FRAME:
+                    self.responses.put((cmd, payload))
+                    continue
+                changed = []
+                mask = payload[0] | (payload[1] << 8)
+                pos = 2
+                if timed:
+                    device_us = self.clock_sync.expand(int.from_bytes(payload[2:6], 'little'))
+                    self.stream_time = None if device_us is None else self.clock_sync.to_wall(device_us)
+                    pos = 6
+                for word in range(16):
+                    if mask & (1 << word):
+                        self.stream_values[word] = payload[pos] | (payload[pos + 1] << 8)
+                        changed.append(word)
+                        pos += 2
+                if self.stream_callback:
+                    self.stream_callback(dict(self.stream_values), changed)
+        if self.stream_reader is threading.current_thread():
+            self.stream_reader = None
+
+    def read_response(self, rsp_len):
+        if not self.stream_reader:
+            # The device announces its length, a rejected command answers with less than was asked for
+            header = self.serial.read(2)
+            if len(header) < 2:
+                return header
+            return header + self.serial.read(min(header[1], rsp_len))
+        try:
+            cmd, payload = self.responses.get(timeout=self.serial.timeout)
+        except queue.Empty:
+            return b''
+        return bytes([cmd, len(payload)]) + payload
+
+    def clear_responses(self):
+        if not self.stream_reader:
+            self.serial.reset_input_buffer()
+            return
+        # Stream frames may be waiting in the port, only drop stale responses
+        while not self.responses.empty():
+            self.responses.get_nowait()
+
+    def request(self, request, max_attempts=None):
+        """ Send a request and return its response.
+
+        max_attempts is only the starting point, once a command has some history
+        on this port the retry policy picks attempts, backoff and timeout.
+        """
+        return self.transact(request, request[2], max_attempts)
+
+    def transact(self, frame, rsp_len, max_attempts=None, timeout=None):
+        """ Send any frame and read a response with rsp_len data bytes.
+
+        A fixed timeout overrides the adaptive one, for commands that take as
+        long as their parameters say. Requests registered with the coalescer as
+        read-only share in-flight and recent responses.
+        """
+        if getattr(self.local, 'exclusive', 0):
+            response = self.device_transact(frame, rsp_len, max_attempts, timeout)
+            if self.coalescer.freshness(frame, rsp_len) is None:
+                self.coalescer.invalidate()
+            return response
+        return self.coalescer.run(frame, rsp_len, lambda: self.device_transact(frame, rsp_len, max_attempts, timeout))
+
+    @contextlib.contextmanager
+    def exclusive(self):
+        """ Hold the port for a sequence of requests that must each reach the device.
+
+        Requests of the sequence skip the coalescer, they neither share nor
+        reuse responses and can't wait on another thread's request, which
+        would need the port.
+        """
+        with self.hold():
+            self.local.exclusive = getattr(self.local, 'exclusive', 0) + 1
+            try:
+                yield
+            finally:
+                self.local.exclusive -= 1
+
+    @contextlib.contextmanager
+    def hold(self):
+        """ Take the device lock, or raise if another thread holds it for something long, see busy. """
+        while not self.lock.acquire(timeout=0.1):
+            busy = self.busy
+            if busy:
+                raise Exception(f"The interface is busy with a {busy}.")
+        try:
+            yield
+        finally:
+            self.lock.release()
+
+    def device_transact(self, frame, rsp_len, max_attempts=None, timeout=None):
+        """ transact() without coalescing. """
+        with self.hold():
+            return self.locked_transact(frame, rsp_len, max_attempts or DEFAULT_ATTEMPTS, timeout)
+
+    def locked_transact(self, request, rsp_len, default_attempts, timeout=None):
+        if not self.serial.is_open:
+            raise Exception(f"Serial port is not open.")
+
+        port = self.serial.port
+        key = retry_policy.RetryPolicy.command_key(request)
+        self.retry_policy.check_port(port)
+        max_attempts = self.retry_policy.attempts(port, key, default_attempts)
+        self.serial.timeout = timeout or self.retry_policy.timeout(port, key)
+
+        rejected = False
+        for attempt in range(1, max_attempts + 1):
+            if attempt > 1:
+                time.sleep(self.retry_policy.backoff(port, key, attempt - 1))
+            payload = request[3:] if request[0] != MACRO_INVOKE_START else request
+            self.obi_instance.update_debug(f">> {' '.join(f'{x:02X}' for x in payload)}")
+            start = time.monotonic()
+            try:
+                self.clear_responses()
+                with self.write_lock:
+                    self.serial.write(bytes(request))
+
+                response = self.read_response(rsp_len)
+                self.obi_instance.update_debug(f"<< {' '.join(f'{x:02X}' for x in response[2:])}")
+                if rsp_len == 0 or obi_codec.check_response(response, rsp_len):
+                    self.retry_policy.record_attempt(port, key, True, time.monotonic() - start)
+                    self.retry_policy.record_request(port, True)
+                    return None if rsp_len == 0 else response
+                if request[0] == 0x01 and response == bytes([request[3], 0]):
+                    rejected = True
+                    break
+
+                if len(response) == rsp_len + 2:
+                    raise ValueError("Invalid response: all bytes are 0xFF")
+                raise TimeoutError(f"Got {len(response)} of {rsp_len + 2} bytes")
+
+            except Exception as e:
+                self.retry_policy.record_attempt(port, key, False)
+                self.obi_instance.update_debug(f"Attempt {attempt}/{max_attempts} failed: {e}")
+
+        if rejected:
+            # The port works, retrying the same parameters can't help
+            self.retry_policy.record_attempt(port, key, True, time.monotonic() - start)
+            self.retry_policy.record_request(port, True)
+            raise RequestRejected(f"The interface rejected command {request[3]:02X}.")
+
+        if self.retry_policy.record_request(port, False):
+            self.obi_instance.update_debug(f"Port {port} keeps failing, quarantined")
+        raise Exception(f"Failed to get a valid response after {max_attempts} attempts.")
@@ -0,0 +1,74 @@
+""" Host side cache of static pack information, keyed by ROM ID.
+
+Entries survive restarts in a small JSON file in the user's home folder, so
+a pack that has been seen before is recognised without probing it again.
+"""
+
+import json
+import os
+import threading
+
+DEFAULT_PATH = os.path.join(os.path.expanduser('~'), '.obi', 'pack_cache.json')
+
+# Entries shared by every pack of a model live next to the ROM ID entries under this prefix
+MODEL_PREFIX = 'model:'
+
+_shared = None
+
+
+def shared():
+    """ The cache instance shared by all modules and connections. """
+    global _shared
+    if _shared is None:
+        _shared = PackCache()
+    return _shared
+
+
+class PackCache:
+    def __init__(self, path=DEFAULT_PATH):
+        self.path = path
+        self.lock = threading.Lock()
+        self.entries = {}
+        self.load()
+
+    def load(self):
+        try:
+            with open(self.path, 'r', encoding='utf-8') as f:
+                self.entries = json.load(f)
+        except (OSError, ValueError):
+            self.entries = {}
+
+    def save(self):
+        try:
+            os.makedirs(os.path.dirname(self.path), exist_ok=True)
+            tmp_path = self.path + '.tmp'
+            with open(tmp_path, 'w', encoding='utf-8') as f:
+                json.dump(self.entries, f, indent=1, sort_keys=True)
+            os.replace(tmp_path, self.path)
+        except OSError:
+            # The cache is only an optimisation, never fail a read because of it
+            pass
+
+    def get(self, rom_id):
+        with self.lock:
+            entry = self.entries.get(rom_id)
+            return dict(entry) if entry else None
+
+    def update(self, rom_id, **fields):
+        with self.lock:
+            entry = self.entries.setdefault(rom_id, {})
+            if all(entry.get(key) == value for key, value in fields.items()):
+                return
+            entry.update(fields)
+            self.save()
+
+    def get_model(self, model):
+        return self.get(MODEL_PREFIX + model)
+
+    def update_model(self, model, **fields):
+        self.update(MODEL_PREFIX + model, **fields)
+
+    def forget(self, rom_id):
+        with self.lock:
+            if self.entries.pop(rom_id, None) is not None:
+                self.save()
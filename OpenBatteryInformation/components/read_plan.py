@@ -0,0 +1,122 @@
+""" Declarative read plans for battery modules.
+
+A module declares its reads once: a name, the request frame, the reads that
+must run before it and the mode it needs. A mode is a list of setup frames,
+like entering test mode, that must run earlier in the same power session.
+The planner orders the reads, runs each mode's setup once per session and
+packs everything into as few device transactions as the firmware BATCH limits
+allow. Without batch support the same frames are sent one by one.
+
+    plan = ReadPlan([Read("cell1", CELL1_CMD, mode="clear"), ...], modes={"clear": [CLEAR_CMD]})
+    responses = plan.run(interface, ["cell1", "cell2"])
+"""
+
+from components import obi_device
+
+
+def supports_batch(interface):
+    return hasattr(interface, 'supports') and interface.supports('batch')
+
+
+class Read:
+    def __init__(self, name, frame, requires=(), mode=None):
+        self.name = name
+        self.frame = list(frame)
+        self.requires = tuple(requires)
+        self.mode = mode
+
+
+class Session:
+    """ Frames run in one transaction, and the read each frame answers (None for setup frames). """
+    def __init__(self):
+        self.frames = []
+        self.reads = []
+        self.modes = set()
+        self.steps = 0
+        self.rsp_len = 0
+
+    def fits(self, frames):
+        steps = self.steps + sum(len(frame) - 1 for frame in frames)
+        rsp_len = self.rsp_len + sum(frame[2] for frame in frames)
+        return steps <= obi_device.BATCH_MAX_STEPS and rsp_len <= obi_device.BATCH_MAX_RSP
+
+    def batchable(self):
+        return all(frame[3] in obi_device.BATCHABLE_COMMANDS for frame in self.frames)
+
+    def add(self, frame, read=None):
+        self.frames.append(frame)
+        self.reads.append(read)
+        self.steps += len(frame) - 1
+        self.rsp_len += frame[2]
+
+
+class ReadPlan:
+    def __init__(self, reads, modes=None):
+        self.reads = {read.name: read for read in reads}
+        self.order = [read.name for read in reads]
+        self.modes = modes or {}
+
+    def resolve(self, names):
+        """ The requested reads and everything they require, dependencies first.
+
+        Among the reads that are ready, one in the mode of the previous read
+        goes next, so reads sharing a mode end up next to each other.
+        """
+        wanted = set()
+        stack = list(names)
+        while stack:
+            name = stack.pop()
+            if name not in self.reads:
+                raise ValueError(f"Unknown read '{name}'")
+            if name not in wanted:
+                wanted.add(name)
+                stack.extend(self.reads[name].requires)
+
+        ordered = []
+        done = set()
+        mode = None
+        while len(ordered) < len(wanted):
+            ready = [name for name in self.order
+                     if name in wanted and name not in done and all(r in done for r in self.reads[name].requires)]
+            if not ready:
+                raise ValueError("Read plan has a dependency cycle")
+            same_mode = [name for name in ready if self.reads[name].mode == mode]
+            name = (same_mode or ready)[0]
+            ordered.append(self.reads[name])
+            done.add(name)
+            mode = self.reads[name].mode
+        return ordered
+
+    def compile(self, names):
+        """ Pack the reads into sessions, each one device transaction. """
+        sessions = [Session()]
+        for read in self.resolve(names):
+            session = sessions[-1]
+            setup = [] if read.mode is None or read.mode in session.modes else self.modes[read.mode]
+            # A session holds one mode, test modes may not combine
+            other_mode = read.mode is not None and session.modes and read.mode not in session.modes
+            if other_mode or not session.fits(setup + [read.frame]):
+                session = Session()
+                sessions.append(session)
+                setup = [] if read.mode is None else self.modes[read.mode]
+            for frame in setup:
+                session.add(frame)
+            if read.mode is not None:
+                session.modes.add(read.mode)
+            session.add(read.frame, read.name)
+        return [session for session in sessions if session.frames]
+
+    def run(self, interface, names):
+        """ Run the reads on interface, returns the response of each read by name, as request() would. """
+        responses = {}
+        batch = supports_batch(interface)
+        for session in self.compile(names):
+            # A single read gains nothing from BATCH, as a plain request it can be coalesced
+            if batch and len(session.frames) > 1 and session.batchable():
+                results = interface.batch(session.frames)
+            else:
+                results = [interface.request(frame) for frame in session.frames]
+            for name, response in zip(session.reads, results):
+                if name is not None:
+                    responses[name] = response
+        return responses
@@ -0,0 +1,175 @@
+""" Adaptive retry policy for interface requests.
+
+Success rate and latency are tracked per port and per command. They decide
+how many attempts a request gets, how long to back off between attempts and
+how long to wait for a response. Ports that keep failing are quarantined for
+a while so they fail fast instead of slowing down every other station.
+"""
+
+import math
+import random
+import threading
+import time
+
+_shared = None
+
+
+def shared():
+    """ The policy instance shared by all connections. """
+    global _shared
+    if _shared is None:
+        _shared = RetryPolicy()
+    return _shared
+
+
+class PortQuarantined(Exception):
+    pass
+
+
+class CommandStats:
+    # Weight of the newest sample in the moving averages
+    ALPHA = 0.2
+
+    def __init__(self):
+        self.samples = 0
+        self.success_rate = 1.0
+        self.latency = 0.0
+        self.latency_dev = 0.0
+
+    def record(self, ok, latency):
+        self.samples += 1
+        self.success_rate += self.ALPHA * ((1.0 if ok else 0.0) - self.success_rate)
+        if ok:
+            if self.latency == 0.0:
+                self.latency = latency
+            else:
+                # Same estimator as TCP's RTO: smoothed mean and mean deviation
+                self.latency_dev += self.ALPHA * (abs(latency - self.latency) - self.latency_dev)
+                self.latency += self.ALPHA * (latency - self.latency)
+
+
+class PortStats:
+    def __init__(self):
+        self.commands = {}
+        self.consecutive_failures = 0
+        self.quarantined_until = 0.0
+        self.quarantine_time = 0.0
+
+
+class RetryPolicy:
+    def __init__(self, max_attempts=6, target_failure=0.01, min_samples=5,
+                 base_backoff=0.05, max_backoff=1.0,
+                 default_timeout=1.0, min_timeout=0.5, max_timeout=3.0,
+                 quarantine_after=3, quarantine_time=30.0, max_quarantine_time=300.0):
+        self.max_attempts = max_attempts
+        self.target_failure = target_failure
+        self.min_samples = min_samples
+        self.base_backoff = base_backoff
+        self.max_backoff = max_backoff
+        self.default_timeout = default_timeout
+        self.min_timeout = min_timeout
+        self.max_timeout = max_timeout
+        self.quarantine_after = quarantine_after
+        self.initial_quarantine_time = quarantine_time
+        self.max_quarantine_time = max_quarantine_time
+        self.lock = threading.Lock()
+        self.ports = {}
+
+    @staticmethod
+    def command_key(request):
+        # Interface command plus the first payload byte, which is the battery command.
+        # Frames without the 0x01 header (macro invokes) are keyed by all their bytes.
+        if request[0] != 0x01:
+            return bytes(request).hex()
+        return bytes(request[3:5]).hex()
+
+    def stats(self, port, key):
+        port_stats = self.ports.setdefault(port, PortStats())
+        return port_stats, port_stats.commands.setdefault(key, CommandStats())
+
+    def check_port(self, port):
+        """ Raise PortQuarantined while the port is in quarantine. """
+        with self.lock:
+            port_stats = self.ports.get(port)
+            if port_stats and port_stats.quarantined_until > time.monotonic():
+                remaining = port_stats.quarantined_until - time.monotonic()
+                raise PortQuarantined(f"Port {port} is quarantined for {remaining:.0f} s after repeated failures.")
+
+    def attempts(self, port, key, default):
+        """ Attempts needed to keep the chance of a failed request below target_failure.
+
+        Never fewer than the caller's default: a command that has been reliable
+        so far still gets its retry when a transient glitch hits it.
+        """
+        with self.lock:
+            _, stats = self.stats(port, key)
+            if stats.samples < self.min_samples or stats.success_rate >= 1.0 - self.target_failure:
+                return default
+            if stats.success_rate < 0.1:
+                # Retrying a command that hardly ever works only wastes time,
+                # repeated failures will quarantine the port instead
+                return default
+            needed = math.ceil(math.log(self.target_failure) / math.log(1.0 - stats.success_rate))
+            return max(default, min(self.max_attempts, needed))
+
+    def timeout(self, port, key):
+        with self.lock:
+            _, stats = self.stats(port, key)
+            if stats.samples < self.min_samples or stats.latency == 0.0:
+                return self.default_timeout
+            timeout = stats.latency + 4 * stats.latency_dev + 0.1
+            return max(self.min_timeout, min(self.max_timeout, timeout))
+
+    def backoff(self, port, key, attempt):
+        """ Delay before retry number `attempt` (1 for the first retry). """
+        with self.lock:
+            _, stats = self.stats(port, key)
+            # Back off harder when the command has been failing a lot lately
+            scale = 1.0 + 3.0 * (1.0 - stats.success_rate)
+        delay = min(self.max_backoff, self.base_backoff * scale * (2 ** (attempt - 1)))
+        return delay * random.uniform(0.5, 1.0)
+
+    def record_attempt(self, port, key, ok, latency=0.0):
+        with self.lock:
+            _, stats = self.stats(port, key)
+            stats.record(ok, latency)
+
+    def record_request(self, port, ok):
+        """ Record the outcome of a whole request. Returns True if the port was just quarantined. """
+        with self.lock:
+            port_stats = self.ports.setdefault(port, PortStats())
+            if ok:
+                port_stats.consecutive_failures = 0
+                port_stats.quarantine_time = 0.0
+                return False
+
+            port_stats.consecutive_failures += 1
+            if port_stats.consecutive_failures < self.quarantine_after:
+                return False
+
+            # Each quarantine in a row lasts twice as long as the previous one
+            if port_stats.quarantine_time:
+                port_stats.quarantine_time = min(self.max_quarantine_time, port_stats.quarantine_time * 2)
+            else:
+                port_stats.quarantine_time = self.initial_quarantine_time
+            port_stats.quarantined_until = time.monotonic() + port_stats.quarantine_time
+            # One probe request is allowed after the quarantine ends
+            port_stats.consecutive_failures = self.quarantine_after - 1
+            return True
+
+    def release(self, port):
+        """ Lift a quarantine, e.g. when the user reconnects the port. """
+        with self.lock:
+            port_stats = self.ports.get(port)
+            if port_stats:
+                port_stats.consecutive_failures = 0
+                port_stats.quarantined_until = 0.0
+                port_stats.quarantine_time = 0.0
+
+    def summary(self, port):
+        with self.lock:
+            port_stats = self.ports.get(port)
+            if not port_stats:
+                return {}
+            return {key: (stats.samples, stats.success_rate, stats.latency)
+                    for key, stats in port_stats.commands.items()}
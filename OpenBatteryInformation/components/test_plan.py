@@ -0,0 +1,168 @@
+""" Test plans: a declarative list of steps run on many stations at once.
+
+A plan is a list of step names, optionally with a repeat count, e.g.
+
+    ["read_model", "read_message", ("sample_data", 5), "led_test", "clear_errors"]
+
+Modules provide the step library, a dict mapping each name to a list of
+(macro slot, obi_codec.Macro) sequences. Steps of one station run in order,
+stations run side by side so the power-up and settle waits of one station
+overlap with the bus traffic of the others. With fewer workers than stations
+the station with the most work left goes next (longest processing time first).
+
+Run `python -m components.test_plan` to plan against the simulator.
+"""
+
+import argparse
+import threading
+import time
+
+from components import pack_simulator
+
+
+def parse_plan(plan, library):
+    """ Expand a plan into a list of (name, sequences) steps. """
+    steps = []
+    for entry in plan:
+        name, repeat = (entry, 1) if isinstance(entry, str) else entry
+        if name not in library:
+            raise ValueError(f"Unknown test plan step '{name}'")
+        steps.extend([(name, library[name])] * repeat)
+    return steps
+
+
+def estimate(sequences, macros=True):
+    """ Modeled duration of a step on the interface, mostly power-up waits. """
+    duration = 0.0
+    for _, sequence in sequences:
+        if macros:
+            duration += pack_simulator.POWER_UP_S + sum(pack_simulator.frame_time(f) for f in sequence.frames)
+        else:
+            duration += sum(pack_simulator.POWER_UP_S + pack_simulator.frame_time(f) for f in sequence.frames)
+    return duration
+
+
+class StationResult:
+    def __init__(self, name):
+        self.name = name
+        self.steps = []
+        self.error = None
+
+    @property
+    def busy(self):
+        return sum(duration for _, duration in self.steps)
+
+
+class PlanRunner:
+    def __init__(self, stations, library, max_parallel=None, log=None, time_scale=1.0):
+        """ stations is a list of (name, interface). Reported times are divided by time_scale. """
+        self.stations = stations
+        self.library = library
+        self.max_parallel = max_parallel or len(stations)
+        self.log = log or (lambda message: None)
+        self.time_scale = time_scale or 1.0
+        self.lock = threading.Lock()
+
+    def run_step(self, interface, sequences):
+        for slot, sequence in sequences:
+            if slot is not None and hasattr(interface, 'supports') and interface.supports('macros'):
+                interface.run_macro(slot, sequence)
+            else:
+                for frame in sequence.frames:
+                    interface.request(frame)
+
+    def run(self, plan):
+        steps = parse_plan(plan, self.library)
+        results = {name: StationResult(name) for name, _ in self.stations}
+        pending = {name: list(steps) for name, _ in self.stations}
+        interfaces = dict(self.stations)
+        busy = set()
+
+        def next_station():
+            # Longest remaining work first, so the last station doesn't start late
+            with self.lock:
+                ready = [name for name in pending if pending[name] and name not in busy]
+                if not ready:
+                    return None
+                name = max(ready, key=lambda n: sum(estimate(s) for _, s in pending[n]))
+                busy.add(name)
+                return name
+
+        def worker():
+            while True:
+                name = next_station()
+                if name is None:
+                    if any(pending.values()):
+                        # Others are still busy with their stations, wait for one to free up
+                        time.sleep(0.001)
+                        continue
+                    return
+                step_name, sequences = pending[name].pop(0)
+                start = time.monotonic()
+                try:
+                    self.run_step(interfaces[name], sequences)
+                    duration = (time.monotonic() - start) / self.time_scale
+                    results[name].steps.append((step_name, duration))
+                    self.log(f"{name}: {step_name} {duration * 1000:.0f} ms")
+                except Exception as e:
+                    results[name].error = f"{step_name}: {e}"
+                    self.log(f"{name}: {step_name} failed: {e}")
+                    with self.lock:
+                        pending[name] = []
+                with self.lock:
+                    busy.discard(name)
+
+        start = time.monotonic()
+        workers = [threading.Thread(target=worker, daemon=True)
+                   for _ in range(min(self.max_parallel, len(self.stations)))]
+        for thread in workers:
+            thread.start()
+        for thread in workers:
+            thread.join()
+        total = (time.monotonic() - start) / self.time_scale
+
+        serial_sum = sum(result.busy for result in results.values())
+        return {
+            'total': total,
+            'serial_sum': serial_sum,
+            'speedup': serial_sum / total if total else 0.0,
+            'stations': list(results.values()),
+        }
+
+
+def format_report(report):
+    lines = [f"Plan time {report['total']:.2f} s, serial sum {report['serial_sum']:.2f} s "
+             f"({report['speedup']:.1f}x)"]
+    for station in report['stations']:
+        status = f"failed at {station.error}" if station.error else "ok"
+        lines.append(f"  {station.name}: {len(station.steps)} steps, {station.busy:.2f} s, {status}")
+    return '\n'.join(lines)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Plan a test run against simulated stations.")
+    parser.add_argument('--stations', type=int, default=4)
+    parser.add_argument('--parallel', type=int, default=None, help="Stations served at once (default: all)")
+    parser.add_argument('--plan', default="read_model,read_message,sample_data*5,led_test,clear_errors",
+                        help="Comma separated steps, name*N repeats a step")
+    parser.add_argument('--no-macros', action='store_true', help="Simulate firmware without macros")
+    parser.add_argument('--time-scale', type=float, default=0.01)
+    args = parser.parse_args()
+
+    # The step library comes from the Makita module, which is the only one with a plan so far
+    from modules import makita_lxt
+
+    plan = []
+    for entry in args.plan.split(','):
+        name, _, repeat = entry.strip().partition('*')
+        plan.append((name, int(repeat or 1)))
+
+    features = () if args.no_macros else ('macros',)
+    stations = [(f"SIM{i + 1}", pack_simulator.SimulatedInterface(time_scale=args.time_scale, features=features))
+                for i in range(args.stations)]
+    runner = PlanRunner(stations, makita_lxt.TEST_PLAN_STEPS, args.parallel, time_scale=args.time_scale)
+    print(format_report(runner.run(plan)))
+
+
+if __name__ == '__main__':
+    main()
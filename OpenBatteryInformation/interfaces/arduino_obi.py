@@ -1,20 +1,17 @@
 import tkinter as tk
 from tkinter import ttk
-import serial
-import serial.tools.list_ports
+from components import obi_device
 
-INTERFACE_VERSION_CMD   = [0x01, 0x00, 0x03, 0x01]
+DISPLAY_NAME = "Arduino OBI"
 
 def get_display_name():
-    return "Arduino OBI"
+    return DISPLAY_NAME
 
-class Interface(tk.Frame):
+class Interface(obi_device.ObiDevice, tk.Frame):
     def __init__(self, parent, obi_instance):
-        super().__init__(parent)
+        tk.Frame.__init__(self, parent)
+        obi_device.ObiDevice.__init__(self, obi_instance)
         self.parent = parent
-        self.obi_instance = obi_instance
-        self.serial = serial.Serial()
-        self.serial.timeout = 1
         self.create_widgets()
 
     def create_widgets(self):
@@ -44,6 +41,8 @@ class Interface(tk.Frame):
 
 
     def get_available_serial_ports(self):
+        # Port enumeration pulls in the platform specific backends, only load it when needed
+        import serial.tools.list_ports
         ports = [port.device for port in serial.tools.list_ports.comports()]
         return ports
 
@@ -56,54 +55,15 @@ class Interface(tk.Frame):
     def open_serial_port(self):
         selected_port = self.conf_port.get()
         if selected_port:
-            self.serial.port = selected_port
             try:
-                self.serial.open()
-                self.update_version()
+                version = self.open(selected_port)
+                self.version_label.config(text=f"Version: {version}")
                 self.obi_instance.update_debug(f"Opened serial port: {selected_port}")
                 self.connect_button.config(text="Disconnect", command=self.close_serial_port)
             except Exception as e:
-                self.serial.close()
                 self.obi_instance.update_debug(f"Error opening serial port {selected_port}: {e}")
 
     def close_serial_port(self):
-        if self.serial.is_open:
-            self.serial.close()
+        if self.close():
             self.obi_instance.update_debug("Closed serial port")
             self.connect_button.config(text="Connect", command=self.open_serial_port)
-
-    def get_version(self):
-        response = self.request(INTERFACE_VERSION_CMD, max_attempts=5)
-        version_string = '.'.join(str(byte) for byte in response[2:])
-    
-        return version_string
-    
-    def update_version(self):
-        self.version_label.config(text=f"Version: {self.get_version()}")
-
-    def request(self, request, max_attempts=2):
-        if not self.serial.is_open:
-            raise Exception(f"Serial port is not open.")
-
-        for attempt in range(1, max_attempts + 1):
-            self.obi_instance.update_debug(f">> {' '.join(f'{x:02X}' for x in request[3:])}")
-            try:
-                self.serial.reset_input_buffer()
-                self.serial.write(request)
-
-                response = self.serial.read(request[2] + 2)
-                self.obi_instance.update_debug(f"<< {' '.join(f'{x:02X}' for x in response[2:])}")
-                if request[2] == 0:
-                    return
-
-                if len(response) == request[2] + 2:
-                    
-                    if all(byte == 0xff for byte in response[2:]):
-                        raise ValueError("Invalid response: all bytes are 0xFF")
-                    
-                    return response
-
-            except Exception as e:
-                self.obi_instance.update_debug(f"Attempt {attempt}/{max_attempts} failed: {e}")
-        raise Exception(f"Failed to get a valid response after {max_attempts} attempts.")
-
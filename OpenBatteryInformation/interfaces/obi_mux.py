@@ -0,0 +1,205 @@
+import tkinter as tk
+from tkinter import ttk
+import contextlib
+import itertools
+import json
+import os
+import socket
+import threading
+from components import obi_codec
+from components import mux_server
+from components import obi_device
+from interfaces import arduino_obi
+
+DISPLAY_NAME = "OBI Mux"
+
+# Time a request may wait in the daemon's queue on top of its own timeout
+QUEUE_TIMEOUT_S = 30
+
+def get_display_name():
+    return DISPLAY_NAME
+
+class Interface(arduino_obi.Interface):
+    """ An ArduinoOBI shared through components.mux_server, so other programs can use it at the same time.
+
+    Every request goes to the daemon, which owns the serial port. All the
+    Arduino OBI features work as they do on a direct connection.
+    """
+    def __init__(self, parent, obi_instance):
+        tk.Frame.__init__(self, parent)
+        self.parent = parent
+        obi_device.ObiDevice.__init__(self, obi_instance)
+        self.sock = None
+        self.reader = None
+        self.calls = {}
+        self.call_ids = itertools.count(1)
+        self.send_lock = threading.Lock()
+        self.priority = mux_server.PRIORITY_INTERACTIVE
+        self.create_widgets()
+
+    def create_widgets(self):
+        socket_label = tk.Label(self, text="Daemon socket:")
+        socket_label.pack(pady=5)
+
+        self.conf_port = ttk.Combobox(self, values=mux_server.list_sockets())
+        self.conf_port.pack(pady=5)
+
+        self.connect_button = tk.Button(self, text="Connect", command=self.toggle_connection)
+        self.connect_button.pack(pady=10)
+        self.connect_button.config(width=20)
+
+        self.refresh_button = tk.Button(self, text="Refresh socket list", command=self.refresh_serial_list)
+        self.refresh_button.pack(pady=10)
+        self.refresh_button.config(width=20)
+
+        self.version_label = tk.Label(self, anchor="w", width=20, text="Version:")
+        self.version_label.pack(pady=5)
+
+    def refresh_serial_list(self):
+        self.conf_port["values"] = mux_server.list_sockets()
+
+    def toggle_connection(self):
+        if self.sock:
+            self.close_serial_port()
+        else:
+            self.open_serial_port()
+
+    def open_serial_port(self):
+        path = self.conf_port.get()
+        if not path:
+            return
+        try:
+            self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            self.sock.connect(path)
+            self.reader = threading.Thread(target=self.read_messages, daemon=True)
+            self.reader.start()
+            hello = self.call('hello')
+            self.serial.port = hello['port']
+            self.firmware_version = tuple(hello['version'])
+            self.version_label.config(text=f"Version: {'.'.join(str(x) for x in self.firmware_version)}")
+            self.obi_instance.update_debug(f"Connected to {hello['port']} through {os.path.basename(path)}")
+            self.connect_button.config(text="Disconnect", command=self.close_serial_port)
+        except Exception as e:
+            self.close_serial_port()
+            self.obi_instance.update_debug(f"Error connecting to {path}: {e}")
+
+    def close_serial_port(self):
+        sock, self.sock = self.sock, None
+        self.stream_reader = None
+        if sock:
+            sock.close()
+            self.obi_instance.update_debug("Disconnected from the multiplexer")
+        self.connect_button.config(text="Connect", command=self.open_serial_port)
+
+    def call(self, op, wait=None, **args):
+        """ Send one operation to the daemon and wait for its result, wait is the device time it may take. """
+        if not self.sock:
+            raise Exception("Not connected to the multiplexer.")
+        call_id = next(self.call_ids)
+        waiter = {'done': threading.Event()}
+        self.calls[call_id] = waiter
+        message = dict(args, id=call_id, op=op, priority=self.priority)
+        # Calls of the thread holding the daemon for an exclusive sequence carry its token
+        token = getattr(self.local, 'token', None)
+        if token is not None:
+            message['exclusive'] = token
+        try:
+            with self.send_lock:
+                self.sock.sendall(json.dumps(message).encode() + b'\n')
+            if not waiter['done'].wait((wait or 0) + QUEUE_TIMEOUT_S):
+                raise TimeoutError(f"No answer from the multiplexer to {op}")
+        finally:
+            self.calls.pop(call_id, None)
+        if 'error' in waiter:
+            raise Exception(waiter['error'])
+        return waiter.get('result')
+
+    def read_messages(self):
+        sock = self.sock
+        try:
+            for line in sock.makefile('rb'):
+                message = json.loads(line)
+                if message.get('event') == 'stream':
+                    values = {int(word): value for word, value in message['values'].items()}
+                    self.stream_values = values
+                    self.stream_time = message.get('time')
+                    if self.stream_callback:
+                        self.stream_callback(dict(values), message['changed'])
+                    continue
+                waiter = self.calls.get(message.get('id'))
+                if waiter:
+                    waiter.update(message)
+                    waiter['done'].set()
+        except (OSError, ValueError):
+            pass
+        for waiter in list(self.calls.values()):
+            waiter['error'] = "Connection to the multiplexer closed"
+            waiter['done'].set()
+        if self.sock is sock:
+            self.obi_instance.call_in_main_thread(self.close_serial_port)
+
+    def transact(self, frame, rsp_len, max_attempts=None, timeout=None):
+        if self.busy and not getattr(self.local, 'exclusive', 0):
+            raise Exception(f"The interface is busy with a {self.busy}.")
+        # Read-only requests are coalesced here and, with the other clients' requests, again in the daemon
+        freshness_s = self.coalescer.freshness(frame, rsp_len)
+
+        def fetch(read_only):
+            response = self.call('transact', timeout, frame=list(frame), rsp_len=rsp_len,
+                                 max_attempts=max_attempts, timeout=timeout, read_only=read_only)
+            return None if response is None else bytes(response)
+
+        if getattr(self.local, 'exclusive', 0):
+            # Not marked read-only, so the daemon neither shares nor reuses the response either
+            response = fetch(None)
+            if freshness_s is None:
+                self.coalescer.invalidate()
+            return response
+        return self.coalescer.run(frame, rsp_len, lambda: fetch(freshness_s))
+
+    @contextlib.contextmanager
+    def exclusive(self):
+        """ ObiDevice.exclusive() for the daemon: it runs no other request, of any client, until the sequence ends. """
+        with self.lock:
+            outermost = not getattr(self.local, 'exclusive', 0)
+            if outermost:
+                token = next(self.call_ids)
+                self.call('exclusive_begin', token=token)
+                self.local.token = token
+            self.local.exclusive = getattr(self.local, 'exclusive', 0) + 1
+            try:
+                yield
+            finally:
+                self.local.exclusive -= 1
+                if outermost:
+                    try:
+                        self.call('exclusive_end')
+                    except Exception:
+                        # The daemon also ends it when the connection closes
+                        pass
+                    self.local.token = None
+
+    def run_macro(self, slot, macro):
+        if not isinstance(macro, obi_codec.Macro):
+            macro = obi_codec.Macro(macro)
+        # The daemon stores and invokes the macro, so clients can't overwrite each other's slot in between
+        return bytes(self.call('macro', slot=slot, frames=[list(frame) for frame in macro.frames]))
+
+    def start_stream(self, frame, interval_ms, heartbeat_s, deadbands, callback, window=0):
+        """ Subscribe to the daemon's stream. Its flow control is the daemon's, so window is not used. """
+        if self.stream_reader:
+            raise Exception("A stream is already running.")
+        self.stream_callback = callback
+        self.stream_values = {}
+        self.call('stream_start', frame=list(frame), interval_ms=interval_ms, heartbeat_s=heartbeat_s,
+                  deadbands={str(word): deadband for word, deadband in deadbands.items()})
+        self.stream_reader = self.reader
+
+    def stop_stream(self):
+        if not self.stream_reader:
+            return
+        self.stream_reader = None
+        self.call('stream_stop')
+
+    def ack_stream(self, count=1):
+        pass
@@ -0,0 +1,45 @@
+import tkinter as tk
+from components import pack_simulator
+
+DISPLAY_NAME = "Simulator"
+
+def get_display_name():
+    return DISPLAY_NAME
+
+class Interface(tk.Frame):
+    """ A simulated Makita LXT pack behind an interface with macro support, timed like the real one. """
+    def __init__(self, parent, obi_instance):
+        super().__init__(parent)
+        self.parent = parent
+        self.obi_instance = obi_instance
+        self.simulator = pack_simulator.SimulatedInterface()
+        self.lock = self.simulator.lock
+        self.create_widgets()
+
+    def create_widgets(self):
+        self.realtime = tk.BooleanVar(value=True)
+        realtime_check = tk.Checkbutton(self, text="Real time", variable=self.realtime, command=self.update_time_scale)
+        realtime_check.pack(pady=5)
+
+        self.busy_label = tk.Label(self, anchor="w", width=20, text="Busy: 0.0 s")
+        self.busy_label.pack(pady=5)
+
+    def update_time_scale(self):
+        self.simulator.time_scale = 1.0 if self.realtime.get() else 0.0
+
+    def update_busy(self):
+        self.obi_instance.call_in_main_thread(
+            lambda: self.busy_label.config(text=f"Busy: {self.simulator.busy_time:.1f} s"))
+
+    def supports(self, feature):
+        return self.simulator.supports(feature)
+
+    def run_macro(self, slot, macro):
+        response = self.simulator.run_macro(slot, macro)
+        self.update_busy()
+        return response
+
+    def request(self, request, max_attempts=None):
+        response = self.simulator.request(request, max_attempts)
+        self.update_busy()
+        return response
@@ -1,11 +1,26 @@
+import time
+STARTUP_T0 = time.perf_counter()
+
 import os
 import sys
+import ast
 import tkinter as tk
 from tkinter import ttk
 import importlib.util
 import pkgutil
+import queue
+import threading
 from components.default_module import DefaultModule
 
+class Session:
+    """ One open interface connection and the pack view bound to it. """
+    def __init__(self, name, interface, settings_tab):
+        self.name = name
+        self.interface = interface
+        self.settings_tab = settings_tab
+        self.view = None
+        self.view_tab = None
+
 class OBI(tk.Tk):
     def __init__(self):
         super().__init__()
@@ -13,7 +28,11 @@ class OBI(tk.Tk):
         self.geometry("1270x720")
         self.set_icon("icon.png")
 
-        self.main_app = None
+        self.active_module = None
+        self.sessions = []
+        self.session_count = 0
+        self.placeholder_tab = None
+        self.main_thread_calls = queue.Queue()
         self.loaded_modules = {}
         self.loaded_interfaces = {}
         self.module_names = {}
@@ -26,7 +45,12 @@ class OBI(tk.Tk):
         self.default_module = DefaultModule(self.main_window)
         self.display_default_content()
 
-        self.current_interface = None
+        self.process_main_thread_calls()
+        self.after_idle(self.report_startup_time)
+
+    def report_startup_time(self):
+        elapsed = (time.perf_counter() - STARTUP_T0) * 1000
+        self.update_debug(f"Startup time: {elapsed:.0f} ms")
 
     def set_icon(self, icon_path):
         if hasattr(sys, '_MEIPASS'):
@@ -65,13 +89,35 @@ class OBI(tk.Tk):
         self.load_interfaces()
         self.interface_combobox.bind("<<ComboboxSelected>>", self.display_interface_settings)
 
-        self.interface_wireframe = tk.Frame(interface_frame, padx=10, pady=10)
-        self.interface_wireframe.pack(fill='both', expand=True, pady=(20, 0))
+        button_frame = tk.Frame(interface_frame)
+        button_frame.pack(fill='x')
+
+        add_button = tk.Button(button_frame, text="Add connection", command=self.add_connection)
+        add_button.pack(side='left', expand=True, padx=2)
+
+        remove_button = tk.Button(button_frame, text="Remove", command=self.remove_connection)
+        remove_button.pack(side='left', expand=True, padx=2)
+
+        # One tab with interface settings per open connection
+        self.interface_tabs = ttk.Notebook(interface_frame)
+        self.interface_tabs.pack(fill='both', expand=True, pady=(20, 0))
+        self.interface_tabs.bind("<<NotebookTabChanged>>", self.on_connection_selected)
+
+        self.read_all_button = tk.Button(interface_frame, text="Read all packs", command=self.read_all_packs)
+        self.read_all_button.pack(pady=10)
+        self.read_all_button.config(width=20)
+
+        self.test_plan_button = tk.Button(interface_frame, text="Run test plan", command=self.run_test_plan)
+        self.test_plan_button.pack(pady=10)
+        self.test_plan_button.config(width=20)
 
     def setup_main_window(self):
         self.main_window = tk.Frame(self, padx=20, pady=20)
         self.main_window.pack(fill='both', expand=True, side='top')
 
+        # One pack view per connection, so several packs can be diagnosed side by side
+        self.pack_views = ttk.Notebook(self.main_window)
+
     def setup_debug_frame(self):
         debug_frame = tk.LabelFrame(self, text="Debug Information", padx=20, pady=20)
         debug_frame.pack(fill='both', expand=False, side='top', padx=5, pady=5)
@@ -86,37 +132,54 @@ class OBI(tk.Tk):
             return os.path.join(sys._MEIPASS, relative_path)
         return os.path.join(os.path.abspath("."), relative_path)
 
-    def load_modules(self):
-        modules_dir = self.get_resource_path('modules')
-        module_names = sorted({name for _, name, _ in pkgutil.iter_modules([modules_dir])})
-
-        display_names = []
-        for module_name in module_names:
+    def read_display_name(self, source_path):
+        """ Read a plugin's display name from its source without importing it.
+
+        Plugins declare a module level DISPLAY_NAME string. Older plugins that
+        only return a constant from get_display_name() are handled too.
+        Returns None when the name can't be determined statically, also when
+        the source is missing (a package or a bundled build) or doesn't parse.
+        """
+        try:
+            with open(source_path, 'r', encoding='utf-8') as f:
+                tree = ast.parse(f.read(), filename=source_path)
+        except (OSError, SyntaxError, ValueError):
+            return None
+
+        for node in tree.body:
+            if isinstance(node, ast.Assign) and isinstance(node.value, ast.Constant) and isinstance(node.value.value, str):
+                if any(isinstance(t, ast.Name) and t.id == 'DISPLAY_NAME' for t in node.targets):
+                    return node.value.value
+            if isinstance(node, ast.FunctionDef) and node.name == 'get_display_name':
+                for stmt in node.body:
+                    if (isinstance(stmt, ast.Return) and isinstance(stmt.value, ast.Constant)
+                            and isinstance(stmt.value.value, str)):
+                        return stmt.value.value
+        return None
+
+    def discover_plugins(self, package):
+        plugins_dir = self.get_resource_path(package)
+        plugin_names = sorted({name for _, name, _ in pkgutil.iter_modules([plugins_dir])})
+
+        discovered = {}
+        for plugin_name in plugin_names:
             try:
-                module = self.import_module(f"modules.{module_name}")
-                display_name = module.get_display_name()
-                self.module_names[display_name] = module_name
-                display_names.append(display_name)
+                display_name = self.read_display_name(os.path.join(plugins_dir, f"{plugin_name}.py"))
+                if display_name is None:
+                    # No static metadata, fall back to importing the plugin
+                    display_name = self.import_module(f"{package}.{plugin_name}").get_display_name()
+                discovered[display_name] = plugin_name
             except Exception as e:
-                self.update_debug(f"Failed to load module '{module_name}': {e}")
+                self.update_debug(f"Failed to load {package[:-1]} '{plugin_name}': {e}")
+        return discovered
 
-        self.module_combobox['values'] = display_names
+    def load_modules(self):
+        self.module_names = self.discover_plugins('modules')
+        self.module_combobox['values'] = list(self.module_names)
 
     def load_interfaces(self):
-        interfaces_dir = self.get_resource_path('interfaces')
-        interface_names = sorted({name for _, name, _ in pkgutil.iter_modules([interfaces_dir])})
-
-        display_names = []
-        for interface_name in interface_names:
-            try:
-                interface = self.import_module(f"interfaces.{interface_name}")
-                display_name = interface.get_display_name()
-                self.interface_names[display_name] = interface_name
-                display_names.append(display_name)
-            except Exception as e:
-                self.update_debug(f"Failed to load interface '{interface_name}': {e}")
-
-        self.interface_combobox['values'] = display_names
+        self.interface_names = self.discover_plugins('interfaces')
+        self.interface_combobox['values'] = list(self.interface_names)
 
     def display_default_content(self):
         self.clear_main_window()
@@ -127,23 +190,165 @@ class OBI(tk.Tk):
         selected_module = self.module_names.get(display_name, None)
 
         if selected_module:
-            module_to_display = self.load_cached_module(selected_module)
+            self.active_module = self.load_cached_module(selected_module)
             self.clear_main_window()
-            self.main_app = module_to_display.ModuleApplication(self.main_window, None, self)
-            self.main_app.set_interface(self.current_interface)
+            for tab in self.pack_views.tabs():
+                self.nametowidget(tab).destroy()
+            self.placeholder_tab = None
+
+            for session in self.sessions:
+                self.add_pack_view(session)
+            if not self.sessions:
+                self.add_pack_view(None)
+            self.pack_views.pack(fill='both', expand=True)
+
+    def add_pack_view(self, session):
+        tab = tk.Frame(self.pack_views)
+        view = self.active_module.ModuleApplication(tab, None, self)
+
+        if session:
+            view.set_interface(session.interface)
+            session.view = view
+            session.view_tab = tab
+            self.pack_views.add(tab, text=session.name)
+        else:
+            view.set_interface(None)
+            self.placeholder_tab = tab
+            self.pack_views.add(tab, text="No interface")
 
     def display_interface_settings(self, event=None):
+        # The first connection opens as soon as an interface is picked,
+        # further ones are added with the "Add connection" button
+        if not self.sessions:
+            self.add_connection()
+
+    def add_connection(self):
         display_name = self.interface_var.get()
         selected_interface = self.interface_names.get(display_name, None)
 
-        if selected_interface:
-            interface_module = self.load_cached_interface(selected_interface)
-            if self.current_interface:
-                self.current_interface.pack_forget()
-            self.current_interface = interface_module.Interface(self.interface_wireframe, self)
-            self.current_interface.pack(fill='both', expand=True)
-            if self.main_app:
-                self.main_app.set_interface(self.current_interface)
+        if not selected_interface:
+            return
+
+        interface_module = self.load_cached_interface(selected_interface)
+        self.session_count += 1
+        name = f"{self.session_count}: {display_name}"
+
+        settings_tab = tk.Frame(self.interface_tabs, padx=10, pady=10)
+        interface = interface_module.Interface(settings_tab, self)
+        interface.pack(fill='both', expand=True)
+        self.interface_tabs.add(settings_tab, text=str(self.session_count))
+
+        session = Session(name, interface, settings_tab)
+        self.sessions.append(session)
+        self.update_debug(f"Added connection {name}")
+
+        if self.active_module:
+            if self.placeholder_tab:
+                self.placeholder_tab.destroy()
+                self.placeholder_tab = None
+            self.add_pack_view(session)
+        self.interface_tabs.select(settings_tab)
+
+    def remove_connection(self):
+        session = self.selected_session()
+        if not session:
+            return
+
+        if hasattr(session.interface, 'close_serial_port'):
+            session.interface.close_serial_port()
+        session.settings_tab.destroy()
+        if session.view_tab:
+            session.view_tab.destroy()
+        self.sessions.remove(session)
+        self.update_debug(f"Removed connection {session.name}")
+
+        if self.active_module and not self.sessions:
+            self.add_pack_view(None)
+
+    def selected_session(self):
+        if not self.interface_tabs.tabs():
+            return None
+        selected = self.interface_tabs.select()
+        for session in self.sessions:
+            if str(session.settings_tab) == selected:
+                return session
+        return None
+
+    def on_connection_selected(self, event=None):
+        session = self.selected_session()
+        if session and session.view_tab:
+            self.pack_views.select(session.view_tab)
+
+    def read_all_packs(self):
+        """ Read every connected pack in parallel, one worker thread per connection. """
+        sessions = [s for s in self.sessions if s.view and hasattr(s.view, 'read_battery_data')]
+        if not sessions:
+            self.update_debug("No pack views to read")
+            return
+
+        self.read_all_button.config(state=tk.DISABLED)
+        pending = {'count': len(sessions), 'start': time.perf_counter()}
+
+        def done():
+            pending['count'] -= 1
+            if pending['count'] == 0:
+                elapsed = (time.perf_counter() - pending['start']) * 1000
+                self.update_debug(f"Read {len(sessions)} packs in {elapsed:.0f} ms")
+                self.read_all_button.config(state=tk.NORMAL)
+
+        def worker(session):
+            try:
+                data = session.view.read_battery_data()
+                self.call_in_main_thread(lambda: session.view.insert_battery_data(data))
+            except Exception as e:
+                self.update_debug(f"{session.name}: read failed: {e}")
+            self.call_in_main_thread(done)
+
+        for session in sessions:
+            threading.Thread(target=worker, args=(session,), daemon=True).start()
+
+    def run_test_plan(self):
+        """ Run the test plan of the active module on all connections, overlapping their waits. """
+        if not self.active_module or not hasattr(self.active_module, 'TEST_PLAN'):
+            self.update_debug("The selected module has no test plan")
+            return
+        if not self.sessions:
+            self.update_debug("No connections to run the test plan on")
+            return
+
+        # Imported on first use, it pulls in the pack simulator and codec that startup doesn't need
+        from components import test_plan
+
+        module = self.active_module
+        stations = [(session.name, session.interface) for session in self.sessions]
+        runner = test_plan.PlanRunner(stations, module.TEST_PLAN_STEPS, log=self.update_debug)
+        self.test_plan_button.config(state=tk.DISABLED)
+
+        def worker():
+            try:
+                report = runner.run(module.TEST_PLAN)
+                self.update_debug(test_plan.format_report(report))
+            except Exception as e:
+                self.update_debug(f"Test plan failed: {e}")
+            self.call_in_main_thread(lambda: self.test_plan_button.config(state=tk.NORMAL))
+
+        threading.Thread(target=worker, daemon=True).start()
+
+    def call_in_main_thread(self, function):
+        """ Run function from the Tk main loop. Safe to call from any thread. """
+        if threading.current_thread() is threading.main_thread():
+            function()
+        else:
+            self.main_thread_calls.put(function)
+
+    def process_main_thread_calls(self):
+        while True:
+            try:
+                function = self.main_thread_calls.get_nowait()
+            except queue.Empty:
+                break
+            function()
+        self.after(20, self.process_main_thread_calls)
 
     def load_cached_module(self, module_name):
         if module_name not in self.loaded_modules:
@@ -173,6 +378,9 @@ class OBI(tk.Tk):
             widget.pack_forget()
 
     def update_debug(self, message):
+        if threading.current_thread() is not threading.main_thread():
+            self.call_in_main_thread(lambda: self.update_debug(message))
+            return
         if hasattr(self, 'debug_text'):  # Check if debug_text is initialized
             self.debug_text.config(state='normal')
             self.debug_text.insert('end', message + '\n')
@@ -1,10 +1,21 @@
 from tkinter import ttk
 from tkinter import messagebox
+from tkinter import simpledialog
+from tkinter import filedialog
 import tkinter as tk
 import time
+import csv
+import threading
+from array import array
+from components import obi_codec
+from components import pack_cache
+from components import exporter
+from components import read_plan
+
+DISPLAY_NAME = "Makita LXT"
 
 def get_display_name():
-    return "Makita LXT"
+    return DISPLAY_NAME
 
 # Command Definitions
 MODEL_CMD           = [0x01, 0x02, 0x10, 0xCC, 0xDC, 0x0C]
@@ -32,6 +43,78 @@ F0513_MODEL_CMD     = [0x01, 0x00, 0x02, 0x31]
 F0513_VERSION_CMD   = [0x01, 0x00, 0x02, 0x32]
 F0513_TESTMODE_CMD  = [0x01, 0x01, 0x00, 0xCC, 0x99]
 
+# Reads by name. The F0513 reads need the pack cleared first, they share one clear per session.
+READ_PLAN = read_plan.ReadPlan([
+    read_plan.Read("message", READ_MSG_CMD),
+    read_plan.Read("model", MODEL_CMD),
+    read_plan.Read("data", READ_DATA_REQUEST),
+    read_plan.Read("f0513_cell1", F0513_VCELL_1_CMD, mode="f0513"),
+    read_plan.Read("f0513_cell2", F0513_VCELL_2_CMD, mode="f0513"),
+    read_plan.Read("f0513_cell3", F0513_VCELL_3_CMD, mode="f0513"),
+    read_plan.Read("f0513_cell4", F0513_VCELL_4_CMD, mode="f0513"),
+    read_plan.Read("f0513_cell5", F0513_VCELL_5_CMD, mode="f0513"),
+    read_plan.Read("f0513_temp", F0513_TEMP_CMD, mode="f0513"),
+], modes={"f0513": [CLEAR_CMD, CLEAR_CMD]})
+F0513_CELL_READS = ["f0513_cell1", "f0513_cell2", "f0513_cell3", "f0513_cell4", "f0513_cell5"]
+
+# Interface EEPROM macro slots, see run_sequence()
+MACRO_LEDS_ON           = 0
+MACRO_LEDS_OFF          = 1
+MACRO_F0513_LEDS_OFF    = 2
+MACRO_RESET_ERROR       = 3
+
+# Sequences run as macros, encoded once here. Newer firmware has these built in.
+LEDS_ON_SEQUENCE        = obi_codec.Macro([TESTMODE_CMD, LEDS_ON_CMD])
+LEDS_OFF_SEQUENCE       = obi_codec.Macro([TESTMODE_CMD, LEDS_OFF_CMD])
+F0513_LEDS_OFF_SEQUENCE = obi_codec.Macro([F0513_TESTMODE_CMD, LEDS_OFF_CMD])
+RESET_ERROR_SEQUENCE    = obi_codec.Macro([TESTMODE_CMD, RESET_ERROR_CMD])
+
+# READ_DATA_REQUEST response words logged by device jobs: pack, cells 1-5, temperatures 1-2
+JOB_FIELD_MASK          = 0x1BF
+JOB_FIELDS              = [("Pack Voltage", 1000), ("Cell 1 Voltage", 1000), ("Cell 2 Voltage", 1000),
+                           ("Cell 3 Voltage", 1000), ("Cell 4 Voltage", 1000), ("Cell 5 Voltage", 1000),
+                           ("Temperature Sensor 1", 100), ("Temperature Sensor 2", 100)]
+
+# Device captures read cells 1-5 and temperature 1 from a READ_DATA_REQUEST shortened to 8 words
+CAPTURE_REQUEST         = [0x01, 0x04, 0x10, 0xCC, 0xD7, 0x00, 0x00, 0xFF]
+CAPTURE_FIRST_CELL      = 1
+CAPTURE_CELLS           = 5
+CAPTURE_TEMP_WORD       = 7
+CAPTURE_PRE             = 8
+CAPTURE_POST            = 9
+CAPTURE_TIMEOUT_S       = 120
+
+# Live stream of the JOB_FIELDS words, with the change in raw units each word must exceed before it is sent
+STREAM_DEADBANDS        = {0: 20, 1: 5, 2: 5, 3: 5, 4: 5, 5: 5, 7: 20, 8: 20}
+STREAM_INTERVAL_MS      = 250
+STREAM_HEARTBEAT_S      = 10
+# Stream updates the GUI may have queued before the device holds back and merges them
+STREAM_WINDOW           = 8
+
+# Requests that don't change the pack, identical ones in flight at the same time share one transaction and
+# their responses are reused for READ_FRESHNESS_S. read_battery_data() also sends READ_DATA_REQUEST as a field read.
+READ_ONLY_REQUESTS      = (MODEL_CMD, READ_DATA_REQUEST, READ_MSG_CMD)
+READ_FRESHNESS_S        = 0.5
+
+# Reads use the latest values of a device job or stream running READ_DATA_REQUEST when they are this fresh
+SNAPSHOT_MAX_AGE_S      = 5
+
+# Columns of recorded snapshots and stream updates, Source is "read" or "stream"
+EXPORT_COLUMNS          = {"Time": float, "Source": str, "Pack Voltage": float,
+                           "Cell 1 Voltage": float, "Cell 2 Voltage": float, "Cell 3 Voltage": float,
+                           "Cell 4 Voltage": float, "Cell 5 Voltage": float, "Cell Voltage Difference": float,
+                           "Temperature Sensor 1": float, "Temperature Sensor 2": float}
+
+# Steps for components.test_plan, each a list of (macro slot or None, sequence)
+TEST_PLAN_STEPS = {
+    "read_model":   [(None, obi_codec.Macro([MODEL_CMD]))],
+    "read_message": [(None, obi_codec.Macro([READ_MSG_CMD]))],
+    "sample_data":  [(None, obi_codec.Macro([READ_DATA_REQUEST]))],
+    "led_test":     [(MACRO_LEDS_ON, LEDS_ON_SEQUENCE), (MACRO_LEDS_OFF, LEDS_OFF_SEQUENCE)],
+    "clear_errors": [(MACRO_RESET_ERROR, RESET_ERROR_SEQUENCE)],
+}
+TEST_PLAN = ["read_model", "read_message", ("sample_data", 5), "led_test", "clear_errors"]
+
 initial_data = {
     "Model": "",
     "Charge count*": "",
@@ -61,11 +144,23 @@ class ModuleApplication(tk.Frame):
         self.interface_module = interface_module
         self.obi_instance = obi_instance
         self.command_version = None
+        self.model = None
         self.battery_present = False
+        self.pack_cache = pack_cache.shared()
+        # Records reads and stream updates to a file while set
+        self.exporter = None
+        # Preallocated decode buffers, reused for every data read
+        self.voltages = array('d', [0.0] * 6)
+        self.temperatures = array('d', [0.0] * 2)
         self.create_widgets()
 
     def set_interface(self, interface_instance):
         self.interface = interface_instance
+        if hasattr(interface_instance, 'coalescer'):
+            for frame in READ_ONLY_REQUESTS:
+                interface_instance.coalescer.register(frame, READ_FRESHNESS_S)
+            interface_instance.coalescer.register(interface_instance.field_read_frame(READ_DATA_REQUEST, JOB_FIELD_MASK),
+                                                  READ_FRESHNESS_S)
 
     def create_widgets(self):
         label = tk.Label(self, text=get_display_name(), font=('Helvetica', 16))
@@ -105,6 +200,16 @@ class ModuleApplication(tk.Frame):
         button4.config(width=20)
         self.buttons.append(button4)
 
+        button11 = tk.Button(column_frame, text="Bus timing margins", command=self.on_timing_margins_click, state=tk.DISABLED)
+        button11.pack(pady=10)
+        button11.config(width=20)
+        self.buttons.append(button11)
+
+        button12 = tk.Button(column_frame, text="Tune bus timing", command=self.on_tune_timing_click, state=tk.DISABLED)
+        button12.pack(pady=10)
+        button12.config(width=20)
+        self.buttons.append(button12)
+
         columns_frame.grid_columnconfigure(2, weight=1)
         column_frame = tk.LabelFrame(columns_frame, text="Reset battery")
         column_frame.grid(row=0, column=2, sticky='nsew', padx=10, pady=10)
@@ -119,6 +224,33 @@ class ModuleApplication(tk.Frame):
         button6.config(width=20)
         self.buttons.append(button6)
 
+        columns_frame.grid_columnconfigure(3, weight=1)
+        column_frame = tk.LabelFrame(columns_frame, text="Device log")
+        column_frame.grid(row=0, column=3, sticky='nsew', padx=10, pady=10)
+
+        button7 = tk.Button(column_frame, text="Start device log", command=self.on_start_job_click, state=tk.DISABLED)
+        button7.pack(pady=10)
+        button7.config(width=20)
+        self.buttons.append(button7)
+
+        button8 = tk.Button(column_frame, text="Save device log", command=self.on_save_job_log_click)
+        button8.pack(pady=10)
+        button8.config(width=20)
+
+        button9 = tk.Button(column_frame, text="Stop device log", command=self.on_stop_job_click)
+        button9.pack(pady=10)
+        button9.config(width=20)
+
+        self.stream_button = tk.Button(column_frame, text="Start live stream", command=self.on_stream_click, state=tk.DISABLED)
+        self.stream_button.pack(pady=10)
+        self.stream_button.config(width=20)
+        self.buttons.append(self.stream_button)
+
+        button10 = tk.Button(column_frame, text="Capture voltage sag", command=self.on_capture_click, state=tk.DISABLED)
+        button10.pack(pady=10)
+        button10.config(width=20)
+        self.buttons.append(button10)
+
         tree_frame = tk.Frame(self)
         tree_frame.pack(pady=20, padx=20, fill='both', expand=True)
 
@@ -150,6 +282,9 @@ class ModuleApplication(tk.Frame):
         clear_button = tk.Button(button_frame, text="Clear", command=self.clear_data)
         clear_button.pack(side="left", padx=5)
 
+        self.record_button = tk.Button(button_frame, text="Record to file", command=self.on_record_click)
+        self.record_button.pack(side="left", padx=5)
+
         button_frame.pack(expand=True)
 
         self.pack(fill='both', expand=True)
@@ -161,45 +296,49 @@ class ModuleApplication(tk.Frame):
         for button in self.buttons:
             button.config(state=tk.NORMAL)
     
-    def get_model(self):
-        try:
+    def get_model(self, response=None):
+        if response is None:
             response = self.interface.request(MODEL_CMD)
-            model = response[2:9].decode('utf-8')
-            self.enable_all_buttons()
-            self.command_version = ""
-            return model
-        except Exception as e:
-            raise e
+        return response[2:9].decode('utf-8')
 
     def get_f0513_model(self):
-        try:
-            # This is currently handled in the interface as there were timing issues. TODO
-            #self.interface.request(F0513_TESTMODE_CMD)
-            response = self.interface.request(F0513_MODEL_CMD)
-            self.interface.request(CLEAR_CMD)
-            self.command_version = "F0513"
+        # This is currently handled in the interface as there were timing issues. TODO
+        #self.interface.request(F0513_TESTMODE_CMD)
+        response = self.interface.request(F0513_MODEL_CMD)
+        self.interface.request(CLEAR_CMD)
+        return (f"BL{response[2]:X}{response[3]:X}")
+
+    def set_command_version(self, command_version):
+        self.command_version = command_version
+        if command_version == "F0513":
             messagebox.showwarning("Limited", "This model only supports diagnostics")
             self.buttons[1].config(state=tk.NORMAL)
-            return (f"BL{response[2]:X}{response[3]:X}")
-        except Exception as e:
-            raise e
-    def nibble_swap(self, byte):
-        upper_nibble = (byte & 0xF0) >> 4  # Extract the upper nibble and shift right by 4 bits
-        lower_nibble = (byte & 0x0F) << 4  # Extract the lower nibble and shift left by 4 bits
-        swapped_byte = upper_nibble | lower_nibble  # Combine the nibbles
-        return swapped_byte
+        else:
+            self.enable_all_buttons()
 
     def on_read_static_click(self):
-        commands = [self.get_model, self.get_f0513_model]
+        # Model probes per protocol variant, LXT first
+        commands = {"": self.get_model, "F0513": self.get_f0513_model}
 
         if not self.interface:
             tk.messagebox.showerror("Error", "No interface specified.")
             return
         try:
-            response = self.interface.request(READ_MSG_CMD)
+            # The timing tuned for the previous pack's model may not suit this one, identify it with the defaults.
+            # set_model() applies the timing of its model once that is known.
+            if hasattr(self.interface, 'supports') and self.interface.supports('reset_timing'):
+                self.interface.set_reset_timing()
+            # With batches the LXT model is read in the same power-up, before knowing if the pack is cached
+            batch = read_plan.supports_batch(self.interface)
+            responses = READ_PLAN.run(self.interface, ["message", "model"] if batch else ["message"])
+            response = responses["message"]
+            if batch:
+                commands[""] = lambda: self.get_model(responses["model"])
             rom_id = ' '.join(f'{byte:02X}' for byte in response[2:10])
+            # The interface reads a bad ROM ID again, one still bad after that must not key the pack cache
+            rom_valid = obi_codec.rom_id_valid(response[2:10])
             raw_msg = ' '.join(f'{byte:02X}' for byte in response[10:42])
-            swapped_bytes = bytearray([self.nibble_swap(response[37]), self.nibble_swap(response[36])])[::-1]
+            swapped_bytes = obi_codec.nibble_swap(response[36:38])
             charge_count = int.from_bytes(swapped_bytes, byteorder='big')
             charge_count = charge_count & 0x0FFF
             lock_nibble = response[30] & 0x0F
@@ -208,14 +347,14 @@ class ModuleApplication(tk.Frame):
                 lock_status = "LOCKED"
             else:
                 lock_status = "UNLOCKED"
-            data = {"ROM ID": rom_id,
+            data = {"ROM ID": rom_id if rom_valid else f"{rom_id} (CRC error)",
                     "Battery message": raw_msg,
                     "Charge count*": charge_count,
                     "State": lock_status,
                     "Status code": f'{error_byte:02X}',
                     "Manufacturing date": f'{response[4]:02}/{response[3]:02}/20{response[2]:02}',
-                    "Capacity": f'{self.nibble_swap(response[26])/10}Ah',
-                    "Battery type": self.nibble_swap(response[21]),
+                    "Capacity": f'{obi_codec.nibble_swap(response[26])/10}Ah',
+                    "Battery type": obi_codec.nibble_swap(response[21]),
             }
             self.insert_battery_data(data)
             self.battery_present = True
@@ -223,13 +362,26 @@ class ModuleApplication(tk.Frame):
             tk.messagebox.showerror("Error", f"{e}")
             return
 
-        for command in commands:
+        # A known pack goes straight to its command set, without probing
+        cached = self.pack_cache.get(rom_id) if rom_valid else None
+        if cached and cached.get("command_version") in commands and cached.get("model"):
+            self.update_debug(f"Using cached model for ROM ID {rom_id}")
+            self.set_command_version(cached["command_version"])
+            self.insert_battery_data({"Model": cached["model"]})
+            self.set_model(cached["model"])
+            return
+
+        for command_version, command in commands.items():
 
             try:
                 model = command()
 
+                if rom_valid:
+                    self.pack_cache.update(rom_id, command_version=command_version, model=model)
+                self.set_command_version(command_version)
                 data = {"Model": model}
                 self.insert_battery_data(data)
+                self.set_model(model)
                 return
 
             except Exception as e:
@@ -237,69 +389,101 @@ class ModuleApplication(tk.Frame):
 
         tk.messagebox.showerror("Error", "Battery is present but not supported.")
 
+    def set_model(self, model):
+        """ Remember the pack model and apply the bus timing tuned for it, if any. """
+        self.model = model
+        timing = self.pack_cache.get_model(model)
+        if not (hasattr(self.interface, 'supports') and self.interface.supports('reset_timing')):
+            return
+        try:
+            if timing and timing.get("reset_low_us"):
+                self.interface.set_reset_timing(timing["reset_low_us"], timing["reset_recovery_us"],
+                                                timing.get("byte_gap_us", 0))
+                self.update_debug(f"Using tuned bus timing for {model}: reset {timing['reset_low_us']} us, "
+                                  f"recovery {timing['reset_recovery_us']} us, "
+                                  f"byte gap {timing.get('byte_gap_us') or 'default'}")
+            else:
+                self.interface.set_reset_timing()
+        except Exception as e:
+            self.update_debug(f"Failed to set bus timing: {e}")
+
+    def run_sequence(self, macro_slot, sequence):
+        """ Send the frames of an obi_codec.Macro in order, as one macro if the interface supports it. """
+        if hasattr(self.interface, 'supports') and self.interface.supports('macros'):
+            return self.interface.run_macro(macro_slot, sequence)
+        for frame in sequence.frames:
+            self.interface.request(frame)
+
+    def update_debug(self, message):
+        if self.obi_instance:
+            self.obi_instance.update_debug(message)
+
     def on_read_data_click(self):
         if not self.interface:
             tk.messagebox.showerror("Error", "No interface specified.")
             return
 
         try:
-            if self.command_version == 'F0513':
-                self.interface.request(CLEAR_CMD)
-                self.interface.request(CLEAR_CMD)
-                cell1 = self.interface.request(F0513_VCELL_1_CMD)
-                cell2 = self.interface.request(F0513_VCELL_2_CMD)
-                cell3 = self.interface.request(F0513_VCELL_3_CMD)
-                cell4 = self.interface.request(F0513_VCELL_4_CMD)
-                cell5 = self.interface.request(F0513_VCELL_5_CMD)
-                temp = self.interface.request(F0513_TEMP_CMD)
-                v_cell1 = int.from_bytes(cell1[2:4], byteorder='little') / 1000
-                v_cell2 = int.from_bytes(cell2[2:4], byteorder='little') / 1000
-                v_cell3 = int.from_bytes(cell3[2:4], byteorder='little') / 1000
-                v_cell4 = int.from_bytes(cell4[2:4], byteorder='little') / 1000
-                v_cell5 = int.from_bytes(cell5[2:4], byteorder='little') / 1000
-                voltages = [v_cell1,v_cell2,v_cell3,v_cell4,v_cell5]
-                v_pack = sum(voltages)
-                v_diff = round(max(voltages) - min(voltages), 2)
-                t_cell = int.from_bytes(temp[2:4], byteorder='little') / 100
-                t_mosfet = ""
-            else:
-                response = self.interface.request(READ_DATA_REQUEST)
-                v_pack = int.from_bytes(response[2:4], byteorder='little') / 1000
-                v_cell1 = int.from_bytes(response[4:6], byteorder='little') / 1000
-                v_cell2 = int.from_bytes(response[6:8], byteorder='little') / 1000
-                v_cell3 = int.from_bytes(response[8:10], byteorder='little') / 1000
-                v_cell4 = int.from_bytes(response[10:12], byteorder='little') / 1000
-                v_cell5 = int.from_bytes(response[12:14], byteorder='little') / 1000
-                voltages = [v_cell1,v_cell2,v_cell3,v_cell4,v_cell5]
-                v_diff = round(max(voltages) - min(voltages), 2)
-                t_cell = int.from_bytes(response[16:18], byteorder='little') / 100
-                t_mosfet = int.from_bytes(response[18:20], byteorder='little') / 100
-
-            battery_data = {
-                "Pack Voltage": v_pack,
-                "Cell 1 Voltage": v_cell1,
-                "Cell 2 Voltage": v_cell2,
-                "Cell 3 Voltage": v_cell3,
-                "Cell 4 Voltage": v_cell4,
-                "Cell 5 Voltage": v_cell5,
-                "Cell Voltage Difference": v_diff,
-                "Temperature Sensor 1": t_cell,
-                "Temperature Sensor 2": t_mosfet
-            }
-
+            battery_data = self.read_battery_data()
             self.insert_battery_data(battery_data)
 
         except Exception as e:
             tk.messagebox.showerror("Error", f"Failed to read battery data: {e}")
 
+    def read_battery_data(self):
+        """ Read the live pack data. Does not touch any widgets, so it can run in a worker thread. """
+        if not self.interface:
+            raise Exception("No interface specified.")
+
+        if self.command_version == 'F0513':
+            responses = READ_PLAN.run(self.interface, F0513_CELL_READS + ["f0513_temp"])
+            temp = responses["f0513_temp"]
+            v_cell1, v_cell2, v_cell3, v_cell4, v_cell5 = [obi_codec.decode_u16le(responses[name], 2, 1, 1000)[0]
+                                                            for name in F0513_CELL_READS]
+            voltages = [v_cell1,v_cell2,v_cell3,v_cell4,v_cell5]
+            v_pack = sum(voltages)
+            v_diff = round(max(voltages) - min(voltages), 2)
+            t_cell = obi_codec.decode_u16le(temp, 2, 1, 100, self.temperatures)[0]
+            t_mosfet = ""
+        else:
+            response = None
+            temp_offset = 16
+            if hasattr(self.interface, 'supports') and self.interface.supports('snapshot'):
+                # Answered from the device's RAM without powering the pack, if a job or stream reads it anyway
+                response = self.interface.read_snapshot(READ_DATA_REQUEST, SNAPSHOT_MAX_AGE_S)
+            if response is None:
+                if hasattr(self.interface, 'supports') and self.interface.supports('field_read'):
+                    # Only the words decoded below, packed, the bus read stops after the second temperature
+                    response = self.interface.read_fields(READ_DATA_REQUEST, JOB_FIELD_MASK)
+                    temp_offset = 14
+                else:
+                    response = READ_PLAN.run(self.interface, ["data"])["data"]
+            v_pack, v_cell1, v_cell2, v_cell3, v_cell4, v_cell5 = obi_codec.decode_u16le(response, 2, 6, 1000, self.voltages)
+            voltages = [v_cell1,v_cell2,v_cell3,v_cell4,v_cell5]
+            v_diff = round(max(voltages) - min(voltages), 2)
+            t_cell, t_mosfet = obi_codec.decode_u16le(response, temp_offset, 2, 100, self.temperatures)
+
+        data = {
+            "Pack Voltage": v_pack,
+            "Cell 1 Voltage": v_cell1,
+            "Cell 2 Voltage": v_cell2,
+            "Cell 3 Voltage": v_cell3,
+            "Cell 4 Voltage": v_cell4,
+            "Cell 5 Voltage": v_cell5,
+            "Cell Voltage Difference": v_diff,
+            "Temperature Sensor 1": t_cell,
+            "Temperature Sensor 2": t_mosfet
+        }
+        self.record("read", data)
+        return data
+
     def on_all_leds_on_click(self):
         if not self.interface:
             tk.messagebox.showerror("Error", "No interface specified.")
             return
 
         try:
-            self.interface.request(TESTMODE_CMD)
-            self.interface.request(LEDS_ON_CMD)
+            self.run_sequence(MACRO_LEDS_ON, LEDS_ON_SEQUENCE)
 
         except Exception as e:
             tk.messagebox.showerror("Error", f"Failed to turn LEDs on: {e}")
@@ -311,11 +495,9 @@ class ModuleApplication(tk.Frame):
 
         try:
             if self.command_version == 'F0513':
-                self.interface.request(F0513_TESTMODE_CMD)
+                self.run_sequence(MACRO_F0513_LEDS_OFF, F0513_LEDS_OFF_SEQUENCE)
             else:
-                self.interface.request(TESTMODE_CMD)
-
-            self.interface.request(LEDS_OFF_CMD)
+                self.run_sequence(MACRO_LEDS_OFF, LEDS_OFF_SEQUENCE)
 
         except Exception as e:
             tk.messagebox.showerror("Error", f"Failed to turn LEDs off: {e}")
@@ -326,8 +508,7 @@ class ModuleApplication(tk.Frame):
             return
 
         try:
-            self.interface.request(TESTMODE_CMD)
-            self.interface.request(RESET_ERROR_CMD)
+            self.run_sequence(MACRO_RESET_ERROR, RESET_ERROR_SEQUENCE)
 
         except Exception as e:
             tk.messagebox.showerror("Error", f"Failed to reset errors: {e}")
@@ -353,6 +534,222 @@ class ModuleApplication(tk.Frame):
         except Exception as e:
             tk.messagebox.showerror("Error", f"Failed to reset message: {e}")
 
+    def supports(self, feature):
+        if not self.interface:
+            tk.messagebox.showerror("Error", "No interface specified.")
+            return False
+        if not (hasattr(self.interface, 'supports') and self.interface.supports(feature)):
+            tk.messagebox.showerror("Error", "The interface firmware does not support this feature.")
+            return False
+        return True
+
+    def on_start_job_click(self):
+        if not self.supports('jobs'):
+            return
+
+        interval = simpledialog.askinteger("Device log", "Sample interval in seconds:",
+                                           initialvalue=60, minvalue=1, maxvalue=65535, parent=self)
+        if not interval:
+            return
+        average = simpledialog.askinteger("Device log", "Samples averaged per log record:",
+                                          initialvalue=1, minvalue=1, maxvalue=255, parent=self)
+        if not average:
+            return
+
+        try:
+            capacity = self.interface.start_job(READ_DATA_REQUEST, interval, JOB_FIELD_MASK, average)
+            hours = capacity * interval * average / 3600
+            tk.messagebox.showinfo("Device log", f"Logging started. The device holds {capacity} records "
+                                                 f"({hours:.1f} h) before the oldest are overwritten.")
+        except Exception as e:
+            tk.messagebox.showerror("Error", f"Failed to start device log: {e}")
+
+    def on_stop_job_click(self):
+        if not self.supports('jobs'):
+            return
+
+        try:
+            self.interface.stop_job()
+        except Exception as e:
+            tk.messagebox.showerror("Error", f"Failed to stop device log: {e}")
+
+    def on_save_job_log_click(self):
+        if not self.supports('jobs'):
+            return
+
+        try:
+            records = self.interface.read_job_log()
+        except Exception as e:
+            tk.messagebox.showerror("Error", f"Failed to read device log: {e}")
+            return
+        if not records:
+            tk.messagebox.showinfo("Device log", "The device log is empty.")
+            return
+
+        path = filedialog.asksaveasfilename(defaultextension=".csv", filetypes=[("CSV", "*.csv")], parent=self)
+        if not path:
+            return
+
+        with open(path, 'w', newline='') as f:
+            writer = csv.writer(f)
+            writer.writerow(["Time", "Seq", "Boot"] + [name for name, _ in JOB_FIELDS])
+            for record in records:
+                record_time = time.strftime('%Y-%m-%d %H:%M:%S', time.localtime(record['time'])) if record['time'] else ""
+                values = [value / scale for value, (_, scale) in zip(record['fields'], JOB_FIELDS)]
+                writer.writerow([record_time, record['seq'], record['boot']] + values)
+
+        last = records[-1]
+        self.insert_battery_data({name: value / scale for value, (name, scale) in zip(last['fields'], JOB_FIELDS)})
+        self.update_debug(f"Saved {len(records)} device log records to {path}")
+
+    def on_timing_margins_click(self):
+        if not self.supports('timing_margins'):
+            return
+
+        try:
+            result = self.interface.timing_margins(READ_DATA_REQUEST)
+        except Exception as e:
+            tk.messagebox.showerror("Error", f"Failed to measure timing margins: {e}")
+            return
+
+        def describe(margin):
+            return "n/a" if margin is None else f"{margin:.2f} us"
+
+        for i, (one, zero) in enumerate(result['margins']):
+            self.update_debug(f"Byte {i}: 1 bits {describe(one)}, 0 bits {describe(zero)}")
+        tk.messagebox.showinfo("Bus timing margins",
+                               f"Smallest margin to the sample point:\n"
+                               f"1 bits rise {describe(result['one_margin'])} before it\n"
+                               f"0 bits are released {describe(result['zero_margin'])} after it")
+
+    def on_tune_timing_click(self):
+        if not self.supports('reset_timing'):
+            return
+        if not self.model:
+            tk.messagebox.showerror("Error", "Read the battery model first.")
+            return
+
+        try:
+            low_us, recovery_us, byte_gap_us = self.interface.tune_reset_timing(READ_MSG_CMD)
+        except Exception as e:
+            tk.messagebox.showerror("Error", f"Failed to tune bus timing: {e}")
+            return
+
+        self.pack_cache.update_model(self.model, reset_low_us=low_us, reset_recovery_us=recovery_us,
+                                     byte_gap_us=byte_gap_us)
+        byte_gap = f"a {byte_gap_us} us" if byte_gap_us else "the default"
+        tk.messagebox.showinfo("Tune bus timing", f"{self.model} packs now use a {low_us} us reset, "
+                                                  f"{recovery_us} us recovery and {byte_gap} byte gap "
+                                                  f"(default 750 us, 410 us and 90 us).")
+
+    def on_stream_click(self):
+        if not self.supports('stream'):
+            return
+
+        try:
+            if self.interface.stream_reader:
+                self.interface.stop_stream()
+                self.stream_button.config(text="Start live stream")
+                return
+
+            def on_update(values, changed):
+                # Recorded with every field, the stream reader keeps the last value of unchanged ones
+                self.record("stream", {name: values[word] / scale
+                                       for word, (name, scale) in zip(STREAM_DEADBANDS, JOB_FIELDS) if word in values},
+                            self.interface.stream_time)
+                data = {name: values[word] / scale
+                        for word, (name, scale) in zip(STREAM_DEADBANDS, JOB_FIELDS) if word in changed}
+                self.obi_instance.call_in_main_thread(lambda: self.show_stream_update(data))
+
+            self.interface.start_stream(READ_DATA_REQUEST, STREAM_INTERVAL_MS, STREAM_HEARTBEAT_S,
+                                        STREAM_DEADBANDS, on_update, STREAM_WINDOW)
+            self.stream_button.config(text="Stop live stream")
+        except Exception as e:
+            tk.messagebox.showerror("Error", f"Live stream failed: {e}")
+
+    def show_stream_update(self, data):
+        self.insert_battery_data(data)
+        # Only now is the update handled, a busy main loop holds the stream back
+        self.interface.ack_stream()
+
+    def on_capture_click(self):
+        if not self.supports('capture'):
+            return
+
+        cell_min = simpledialog.askfloat("Capture", "Trigger when a cell drops below (V):",
+                                         initialvalue=3.0, minvalue=0.5, maxvalue=4.5, parent=self)
+        if not cell_min:
+            return
+        spread_max = simpledialog.askinteger("Capture", "or when the cell spread exceeds (mV, 0 = off):",
+                                             initialvalue=0, minvalue=0, maxvalue=5000, parent=self)
+        if spread_max is None:
+            return
+
+        self.update_debug(f"Waiting up to {CAPTURE_TIMEOUT_S} s for a trigger...")
+
+        # The device holds the port until the trigger fires, keep the GUI responsive meanwhile
+        def worker():
+            try:
+                result = self.interface.capture(CAPTURE_REQUEST, CAPTURE_FIRST_CELL, CAPTURE_CELLS, CAPTURE_TEMP_WORD,
+                                                CAPTURE_PRE, CAPTURE_POST, cell_min=int(cell_min * 1000),
+                                                spread_max=spread_max, timeout_s=CAPTURE_TIMEOUT_S)
+                self.obi_instance.call_in_main_thread(lambda: self.save_capture(result))
+            except Exception as e:
+                self.obi_instance.call_in_main_thread(
+                    lambda: tk.messagebox.showerror("Error", f"Capture failed: {e}"))
+
+        threading.Thread(target=worker, daemon=True).start()
+
+    def save_capture(self, result):
+        if result['trigger'] is None:
+            tk.messagebox.showinfo("Capture", "No trigger within the timeout.")
+            return
+
+        path = filedialog.asksaveasfilename(defaultextension=".csv", filetypes=[("CSV", "*.csv")], parent=self,
+                                            title=f"Save capture ({result['reason']})")
+        if not path:
+            return
+
+        with open(path, 'w', newline='') as f:
+            writer = csv.writer(f)
+            writer.writerow(["Time (s)"] + [f"Cell {i + 1} Voltage" for i in range(CAPTURE_CELLS)]
+                            + ["Temperature Sensor 1"])
+            for sample in result['samples']:
+                writer.writerow([f"{sample['time']:.3f}"] + [v / 1000 for v in sample['cells']]
+                                + [sample['temp'] / 100])
+        self.update_debug(f"Saved {len(result['samples'])} capture samples to {path}")
+
+    def on_record_click(self):
+        if self.exporter:
+            exporter_instance, self.exporter = self.exporter, None
+            self.record_button.config(text="Record to file")
+            try:
+                exporter_instance.close()
+            except Exception as e:
+                tk.messagebox.showerror("Error", f"Recording failed: {e}")
+                return
+            dropped = f", {exporter_instance.dropped} dropped" if exporter_instance.dropped else ""
+            self.update_debug(f"Recorded {exporter_instance.written} rows to {exporter_instance.path}{dropped}")
+            return
+
+        path = filedialog.asksaveasfilename(defaultextension=".csv", parent=self, title="Record to file",
+                                            filetypes=[("CSV", "*.csv"), ("Parquet", "*.parquet")])
+        if not path:
+            return
+        try:
+            self.exporter = exporter.open_exporter(path, EXPORT_COLUMNS)
+        except Exception as e:
+            tk.messagebox.showerror("Error", f"Failed to start recording: {e}")
+            return
+        self.record_button.config(text="Stop recording")
+        self.update_debug(f"Recording reads and stream updates to {path}")
+
+    def record(self, source, data, timestamp=None):
+        """ Queue a row for the open recording, at the device's timestamp if it has one. Safe to call from worker and stream threads. """
+        exporter_instance = self.exporter
+        if exporter_instance:
+            exporter_instance.write(dict(data, Time=timestamp or time.time(), Source=source))
+
     def insert_battery_data(self, data):
         for idx, (parameter, value) in enumerate(data.items()):
             item_id = None
@@ -0,0 +1,327 @@
+// Native implementation of components/obi_codec.py.
+//
+// Build with `python setup.py build_ext --inplace` from the OpenBatteryInformation
+// folder. Every function here must behave exactly like its pure Python twin in
+// obi_codec.py, which is used whenever this module is not built.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <cstdint>
+#include <cstring>
+
+namespace {
+
+const uint8_t FRAME_START = 0x01;
+
+// RAII wrapper so every early return releases the buffer view.
+class BufferView {
+public:
+    BufferView() : copy_(nullptr) { std::memset(&view_, 0, sizeof(view_)); }
+    ~BufferView() {
+        if (view_.obj)
+            PyBuffer_Release(&view_);
+        Py_XDECREF(copy_);
+    }
+
+    bool acquire(PyObject *obj, int flags) { return PyObject_GetBuffer(obj, &view_, flags) == 0; }
+
+    // Read-only view of bytes-like objects, and of any other sequence of ints
+    // through a bytes copy, which raises ValueError for values outside 0..255
+    // like bytes() in the Python version does.
+    bool acquire_bytes(PyObject *obj) {
+        if (PyObject_CheckBuffer(obj))
+            return acquire(obj, PyBUF_SIMPLE);
+        copy_ = PyBytes_FromObject(obj);
+        return copy_ && acquire(copy_, PyBUF_SIMPLE);
+    }
+
+    const uint8_t *data() const { return static_cast<const uint8_t *>(view_.buf); }
+    Py_ssize_t size() const { return view_.len; }
+    Py_buffer &view() { return view_; }
+
+private:
+    Py_buffer view_;
+    PyObject *copy_;
+};
+
+// Parse a byte sized int, out of range values raise ValueError like bytes([value]) does.
+bool parse_byte(PyObject *obj, unsigned char *value) {
+    long v = PyLong_AsLong(obj);
+    if (v == -1 && PyErr_Occurred()) {
+        if (!PyErr_ExceptionMatches(PyExc_OverflowError))
+            return false;
+        PyErr_Clear();
+        v = -1;
+    }
+    if (v < 0 || v > 255) {
+        PyErr_SetString(PyExc_ValueError, "bytes must be in range(0, 256)");
+        return false;
+    }
+    *value = static_cast<unsigned char>(v);
+    return true;
+}
+
+uint8_t crc8_update(uint8_t crc, uint8_t data) {
+    crc ^= data;
+    for (int i = 0; i < 8; i++)
+        crc = (crc & 0x01) ? (crc >> 1) ^ 0x8C : crc >> 1;
+    return crc;
+}
+
+uint16_t crc16_update(uint16_t crc, uint8_t data) {
+    crc ^= data;
+    for (int i = 0; i < 8; i++)
+        crc = (crc & 0x0001) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+    return crc;
+}
+
+uint8_t swap_nibbles(uint8_t b) {
+    return static_cast<uint8_t>((b >> 4) | (b << 4));
+}
+
+PyObject *py_crc8(PyObject *, PyObject *args) {
+    PyObject *obj;
+    if (!PyArg_ParseTuple(args, "O:crc8", &obj))
+        return nullptr;
+
+    BufferView buf;
+    if (!buf.acquire_bytes(obj))
+        return nullptr;
+
+    uint8_t crc = 0;
+    for (Py_ssize_t i = 0; i < buf.size(); i++)
+        crc = crc8_update(crc, buf.data()[i]);
+    return PyLong_FromLong(crc);
+}
+
+PyObject *py_crc16(PyObject *, PyObject *args) {
+    PyObject *obj;
+    unsigned int crc = 0;
+    if (!PyArg_ParseTuple(args, "O|I:crc16", &obj, &crc))
+        return nullptr;
+
+    BufferView buf;
+    if (!buf.acquire_bytes(obj))
+        return nullptr;
+
+    uint16_t value = static_cast<uint16_t>(crc);
+    for (Py_ssize_t i = 0; i < buf.size(); i++)
+        value = crc16_update(value, buf.data()[i]);
+    return PyLong_FromLong(value);
+}
+
+PyObject *py_encode_frame(PyObject *, PyObject *args) {
+    PyObject *cmd_obj;
+    PyObject *payload_obj = nullptr;
+    PyObject *rsp_len_obj = nullptr;
+    unsigned char cmd;
+    unsigned char rsp_len = 0;
+    if (!PyArg_ParseTuple(args, "O|OO:encode_frame", &cmd_obj, &payload_obj, &rsp_len_obj))
+        return nullptr;
+
+    BufferView payload;
+    if (payload_obj && !payload.acquire_bytes(payload_obj))
+        return nullptr;
+
+    Py_ssize_t len = payload_obj ? payload.size() : 0;
+    if (len > 255) {
+        PyErr_SetString(PyExc_ValueError, "bytes must be in range(0, 256)");
+        return nullptr;
+    }
+    if (!parse_byte(cmd_obj, &cmd) || (rsp_len_obj && !parse_byte(rsp_len_obj, &rsp_len)))
+        return nullptr;
+
+    PyObject *frame = PyBytes_FromStringAndSize(nullptr, len + 4);
+    if (!frame)
+        return nullptr;
+    uint8_t *out = reinterpret_cast<uint8_t *>(PyBytes_AS_STRING(frame));
+    out[0] = FRAME_START;
+    out[1] = static_cast<uint8_t>(len);
+    out[2] = rsp_len;
+    out[3] = cmd;
+    if (len)
+        std::memcpy(out + 4, payload.data(), len);
+    return frame;
+}
+
+PyObject *py_check_response(PyObject *, PyObject *args) {
+    PyObject *obj;
+    Py_ssize_t rsp_len;
+    if (!PyArg_ParseTuple(args, "On:check_response", &obj, &rsp_len))
+        return nullptr;
+
+    BufferView buf;
+    if (!buf.acquire_bytes(obj))
+        return nullptr;
+
+    if (buf.size() != rsp_len + 2)
+        Py_RETURN_FALSE;
+    if (rsp_len == 0)
+        Py_RETURN_TRUE;
+    for (Py_ssize_t i = 2; i < buf.size(); i++) {
+        if (buf.data()[i] != 0xFF)
+            Py_RETURN_TRUE;
+    }
+    Py_RETURN_FALSE;
+}
+
+PyObject *py_decode_u16le(PyObject *, PyObject *args) {
+    PyObject *obj;
+    Py_ssize_t offset, count;
+    double divisor = 1.0;
+    PyObject *out = Py_None;
+    if (!PyArg_ParseTuple(args, "Onn|dO:decode_u16le", &obj, &offset, &count, &divisor, &out))
+        return nullptr;
+
+    BufferView buf;
+    if (!buf.acquire_bytes(obj))
+        return nullptr;
+
+    if (offset < 0 || count < 0 || offset + count * 2 > buf.size()) {
+        PyErr_SetString(PyExc_ValueError, "Buffer too short");
+        return nullptr;
+    }
+    if (divisor == 0.0) {
+        PyErr_SetString(PyExc_ZeroDivisionError, "division by zero");
+        return nullptr;
+    }
+    const uint8_t *src = buf.data() + offset;
+
+    // A writable double buffer (array('d')) is filled without creating any objects
+    if (out != Py_None && PyObject_CheckBuffer(out)) {
+        BufferView dst;
+        if (!dst.acquire(out, PyBUF_WRITABLE | PyBUF_FORMAT))
+            return nullptr;
+        if (!dst.view().format || std::strcmp(dst.view().format, "d") != 0) {
+            PyErr_SetString(PyExc_TypeError, "Output buffer must hold doubles");
+            return nullptr;
+        }
+        if (dst.size() < count * static_cast<Py_ssize_t>(sizeof(double))) {
+            PyErr_SetString(PyExc_ValueError, "Output buffer too short");
+            return nullptr;
+        }
+        double *values = static_cast<double *>(dst.view().buf);
+        for (Py_ssize_t i = 0; i < count; i++)
+            values[i] = (src[i * 2] | (src[i * 2 + 1] << 8)) / divisor;
+        Py_INCREF(out);
+        return out;
+    }
+
+    if (out != Py_None) {
+        if (PyObject_Length(out) < count) {
+            if (!PyErr_Occurred())
+                PyErr_SetString(PyExc_ValueError, "Output buffer too short");
+            return nullptr;
+        }
+        for (Py_ssize_t i = 0; i < count; i++) {
+            PyObject *value = PyFloat_FromDouble((src[i * 2] | (src[i * 2 + 1] << 8)) / divisor);
+            if (!value || PySequence_SetItem(out, i, value) < 0) {
+                Py_XDECREF(value);
+                return nullptr;
+            }
+            Py_DECREF(value);
+        }
+        Py_INCREF(out);
+        return out;
+    }
+
+    // No output given, return a new array('d') like the Python version does
+    PyObject *array_mod = PyImport_ImportModule("array");
+    if (!array_mod)
+        return nullptr;
+    PyObject *zeros = PyBytes_FromStringAndSize(nullptr, count * static_cast<Py_ssize_t>(sizeof(double)));
+    if (!zeros) {
+        Py_DECREF(array_mod);
+        return nullptr;
+    }
+    double *values = reinterpret_cast<double *>(PyBytes_AS_STRING(zeros));
+    for (Py_ssize_t i = 0; i < count; i++)
+        values[i] = (src[i * 2] | (src[i * 2 + 1] << 8)) / divisor;
+    PyObject *result = PyObject_CallMethod(array_mod, "array", "sO", "d", zeros);
+    Py_DECREF(zeros);
+    Py_DECREF(array_mod);
+    return result;
+}
+
+PyObject *py_nibble_swap(PyObject *, PyObject *args) {
+    PyObject *obj;
+    if (!PyArg_ParseTuple(args, "O:nibble_swap", &obj))
+        return nullptr;
+
+    if (PyLong_Check(obj)) {
+        // Only the low byte matters, so any int works, as in the Python version
+        unsigned long value = PyLong_AsUnsignedLongMask(obj);
+        if (value == static_cast<unsigned long>(-1) && PyErr_Occurred())
+            return nullptr;
+        return PyLong_FromUnsignedLong(((value & 0xF0) >> 4) | ((value & 0x0F) << 4));
+    }
+
+    BufferView buf;
+    if (!buf.acquire_bytes(obj))
+        return nullptr;
+
+    PyObject *result = PyBytes_FromStringAndSize(nullptr, buf.size());
+    if (!result)
+        return nullptr;
+    uint8_t *out = reinterpret_cast<uint8_t *>(PyBytes_AS_STRING(result));
+    for (Py_ssize_t i = 0; i < buf.size(); i++)
+        out[i] = swap_nibbles(buf.data()[i]);
+    return result;
+}
+
+PyObject *py_split_frames(PyObject *, PyObject *args) {
+    PyObject *obj;
+    if (!PyArg_ParseTuple(args, "O:split_frames", &obj))
+        return nullptr;
+
+    BufferView buf;
+    if (!buf.acquire_bytes(obj))
+        return nullptr;
+
+    PyObject *frames = PyList_New(0);
+    if (!frames)
+        return nullptr;
+
+    const uint8_t *data = buf.data();
+    Py_ssize_t pos = 0;
+    while (pos + 2 <= buf.size()) {
+        Py_ssize_t length = data[pos + 1];
+        if (pos + 2 + length > buf.size())
+            break;
+        PyObject *frame = Py_BuildValue("(iy#)", data[pos], data + pos + 2, length);
+        if (!frame || PyList_Append(frames, frame) < 0) {
+            Py_XDECREF(frame);
+            Py_DECREF(frames);
+            return nullptr;
+        }
+        Py_DECREF(frame);
+        pos += 2 + length;
+    }
+
+    PyObject *result = Py_BuildValue("(On)", frames, pos);
+    Py_DECREF(frames);
+    return result;
+}
+
+PyMethodDef methods[] = {
+    {"crc8", py_crc8, METH_VARARGS, "Dallas/Maxim 8 bit CRC."},
+    {"crc16", py_crc16, METH_VARARGS, "Dallas/Maxim 16 bit CRC."},
+    {"encode_frame", py_encode_frame, METH_VARARGS, "Build a request frame."},
+    {"check_response", py_check_response, METH_VARARGS, "Validate a response frame."},
+    {"decode_u16le", py_decode_u16le, METH_VARARGS, "Decode little endian uint16 values."},
+    {"nibble_swap", py_nibble_swap, METH_VARARGS, "Swap nibbles of an int or of every byte."},
+    {"split_frames", py_split_frames, METH_VARARGS, "Split a stream of response frames."},
+    {nullptr, nullptr, 0, nullptr}
+};
+
+PyModuleDef module = {
+    PyModuleDef_HEAD_INIT, "_obi_native", "Native OBI frame codec.", -1, methods,
+    nullptr, nullptr, nullptr, nullptr
+};
+
+} // namespace
+
+PyMODINIT_FUNC PyInit__obi_native(void) {
+    return PyModule_Create(&module);
+}
@@ -10,11 +10,12 @@ a = Analysis(
         ('interfaces', 'interfaces'),
         ('icon.png', '.')
     ],
-    hiddenimports=['modules', 'interfaces', 'interfaces.arduino_obi', 'modules.makita_lxt'],
+    hiddenimports=['modules', 'interfaces', 'interfaces.arduino_obi', 'modules.makita_lxt', 'components._obi_native'],
     hookspath=[],
     hooksconfig={},
     runtime_hooks=[],
-    excludes=[],
+    # Not used by OBI, keeps the onefile archive small so it unpacks faster at startup
+    excludes=['PIL', 'unittest', 'doctest', 'pydoc', 'pdb', 'xmlrpc'],
     noarchive=False,
 )
 pyz = PYZ(a.pure)
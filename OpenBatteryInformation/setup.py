@@ -0,0 +1,15 @@
+# Builds the optional native codec used by components/obi_codec.py:
+#   python setup.py build_ext --inplace
+# OBI works without it, using the pure Python implementation instead.
+from setuptools import setup, Extension
+
+setup(
+    name='obi-native',
+    ext_modules=[
+        Extension(
+            'components._obi_native',
+            sources=['native/obi_native.cpp'],
+            language='c++',
+        )
+    ],
+)
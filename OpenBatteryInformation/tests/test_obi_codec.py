@@ -0,0 +1,107 @@
+""" The native codec must behave like the pure Python one in components/obi_codec.py.
+
+Run from the OpenBatteryInformation folder, after building the native codec
+with `python setup.py build_ext --inplace`:
+
+    python -m unittest discover tests
+"""
+
+import importlib.util
+import sys
+import unittest
+from array import array
+
+from components import obi_codec
+
+
+def load_python_codec():
+    """ A separate copy of obi_codec that uses its Python implementations. """
+    saved = sys.modules.get('components._obi_native')
+    sys.modules['components._obi_native'] = None
+    try:
+        spec = importlib.util.find_spec('components.obi_codec')
+        codec = importlib.util.module_from_spec(spec)
+        spec.loader.exec_module(codec)
+    finally:
+        if saved is None:
+            del sys.modules['components._obi_native']
+        else:
+            sys.modules['components._obi_native'] = saved
+    return codec
+
+
+python_codec = load_python_codec()
+
+BUFFERS = [b'', b'\x00', b'\xff' * 4, bytes(range(256)), bytearray(b'\x33\xd4\x2c'), memoryview(b'\x01\x02\x03'),
+           [0x01, 0x28, 0x33], (0xAB, 0xCD), array('B', [0x10, 0x20])]
+BAD_BUFFERS = [[256], [-1], ['a'], None, 'text', 3]
+
+
+def outcome(function, *args):
+    """ The result of a call, or the type of the exception it raised. """
+    try:
+        result = function(*args)
+    except Exception as e:
+        return type(e)
+    if isinstance(result, array):
+        return 'array', list(result)
+    return result
+
+
+@unittest.skipUnless(obi_codec.NATIVE, "The native codec is not built")
+class NativeMatchesPython(unittest.TestCase):
+    def assert_same(self, name, *args):
+        native = outcome(getattr(obi_codec, name), *args)
+        python = outcome(getattr(python_codec, name), *args)
+        self.assertEqual(native, python, f"{name}{args!r}")
+
+    def test_python_codec_is_pure(self):
+        self.assertFalse(python_codec.NATIVE)
+
+    def test_crc(self):
+        for buf in BUFFERS + BAD_BUFFERS:
+            self.assert_same('crc8', buf)
+            self.assert_same('crc16', buf)
+            self.assert_same('crc16', buf, 0x1234)
+
+    def test_encode_frame(self):
+        for payload in BUFFERS + BAD_BUFFERS:
+            self.assert_same('encode_frame', 0x33, payload, 0x28)
+        for cmd, rsp_len in [(0, 0), (255, 255), (0x33, 256), (0x33, -1), (256, 0), (-1, 0), (0x33, 'a')]:
+            self.assert_same('encode_frame', cmd, b'\x01', rsp_len)
+        self.assert_same('encode_frame', 0x01)
+        self.assert_same('encode_frame', 0x01, bytes(256), 0)
+
+    def test_check_response(self):
+        for response, rsp_len in [(b'\x33\x02\x01\x02', 2), (b'\x33\x02\xff\xff', 2), ([0x33, 0x00], 0),
+                                  ([0x33, 0x02, 0x01], 2), (b'', 0), (b'\x33\x02\x01\x02', -1),
+                                  ([0x33, 0x01, 0x100], 1), (None, 0)]:
+            self.assert_same('check_response', response, rsp_len)
+
+    def test_decode_u16le(self):
+        buf = bytes(range(16))
+        for args in [(0, 8), (3, 2, 10), (0, 0), (0, 9), (-2, 1), (0, -1), (0, 2, 0), (0, 2, 1000.0)]:
+            self.assert_same('decode_u16le', buf, *args)
+        self.assert_same('decode_u16le', list(buf), 2, 3, 2)
+        self.assert_same('decode_u16le', [0x100, 0x01], 0, 1)
+        for native_out, python_out in [(array('d', [0.0] * 4), array('d', [0.0] * 4)), ([0] * 4, [0] * 4)]:
+            obi_codec.decode_u16le(buf, 0, 4, 100, native_out)
+            python_codec.decode_u16le(buf, 0, 4, 100, python_out)
+            self.assertEqual(list(native_out), list(python_out))
+        self.assert_same('decode_u16le', buf, 0, 4, 1, [0] * 3)
+
+    def test_nibble_swap(self):
+        for value in [0, 0x12, 0xFF, 0x1234, -1, 1 << 70]:
+            self.assert_same('nibble_swap', value)
+        for buf in BUFFERS + BAD_BUFFERS[:-1]:
+            self.assert_same('nibble_swap', buf)
+
+    def test_split_frames(self):
+        for buf in [b'', b'\x52', b'\x52\x00', b'\x52\x02\x01\x02\x53\x01\x05', b'\x52\x03\x01', [0x52, 0x01, 0x07]]:
+            self.assert_same('split_frames', buf)
+        for buf in BAD_BUFFERS:
+            self.assert_same('split_frames', buf)
+
+
+if __name__ == '__main__':
+    unittest.main()